@@ -0,0 +1,925 @@
+/* EdFS -- An educational file system
+ *
+ * Copyright (C) 2019  Leiden University, The Netherlands.
+ */
+
+#include "edfs-bcache.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <stdint.h>
+
+#define BCACHE_NONE (-1)
+
+struct _edfs_bcache
+{
+  edfs_io_t     *io;
+  uint16_t       block_size;
+  uint32_t       n_blocks;
+
+  edfs_buf_t    *frames;
+  size_t         n_frames;
+  uint8_t       *memory;
+
+  /* Disk block number -> frame index, or BCACHE_NONE. */
+  int32_t       *map;
+
+  size_t         clock_hand;
+
+  /* Write-back state. The flush arrays have room for every frame and
+   * are used by one write-back pass at a time, the one that set
+   * flush_active.
+   */
+  size_t         n_dirty;
+  size_t         dirty_limit;
+  bool           flush_active;
+  edfs_buf_t   **flush_frames;
+  struct iovec  *flush_iov;
+  edfs_io_req_t *flush_reqs;
+
+  pthread_t      flusher;
+  bool           flusher_running;
+  bool           flusher_stop;
+  uint64_t       flusher_passes;
+  pthread_cond_t flusher_cond;      /* wakes the flusher */
+  pthread_cond_t pass_cond;         /* a flusher pass has finished */
+  edfs_bcache_flush_fn flush_hook;  /* see edfs_bcache_set_flush_hook() */
+  void          *flush_hook_data;
+  pthread_cond_t io_cond;           /* frame I/O finished, or unpinned */
+
+  /* Protects the frame table, the map and the frame flags. It is
+   * dropped for I/O on a miss or write-back. Frame contents are
+   * protected by whoever owns the block (see edfs-common.h), and are
+   * only modified while the frame is pinned; write-back skips pinned
+   * frames.
+   */
+  pthread_mutex_t lock;
+
+  edfs_bcache_stats_t stats;
+};
+
+
+static inline off_t
+bcache_block_offset(edfs_bcache_t *bc, edfs_block_t block)
+{
+  return (off_t)bc->block_size * block;
+}
+
+static uint64_t
+bcache_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void
+bcache_set_clean(edfs_bcache_t *bc, edfs_buf_t *buf)
+{
+  if (buf->dirty)
+    {
+      buf->dirty = false;
+      bc->n_dirty--;
+    }
+}
+
+/* Start writing back @buf: it is clean from now on, unless modified
+ * during the write, and stays pinned until bcache_end_writeback().
+ */
+static void
+bcache_begin_writeback(edfs_bcache_t *bc, edfs_buf_t *buf)
+{
+  bcache_set_clean(bc, buf);
+  buf->writeback = true;
+  buf->pin_count++;
+}
+
+static void
+bcache_end_writeback(edfs_bcache_t *bc, edfs_buf_t *buf, bool ok)
+{
+  buf->writeback = false;
+  buf->pin_count--;
+  if (ok)
+    bc->stats.writebacks++;
+  else if (!buf->dirty)
+    {
+      buf->dirty = true;
+      bc->n_dirty++;
+    }
+}
+
+/* Write back @buf, with the lock held; it is dropped for the write. */
+static int
+bcache_writeback(edfs_bcache_t *bc, edfs_buf_t *buf)
+{
+  bcache_begin_writeback(bc, buf);
+  pthread_mutex_unlock(&bc->lock);
+
+  int rc = edfs_io_write(bc->io, buf->data, bc->block_size,
+                         bcache_block_offset(bc, buf->block));
+
+  pthread_mutex_lock(&bc->lock);
+  bcache_end_writeback(bc, buf, rc == 0);
+  pthread_cond_broadcast(&bc->io_cond);
+  return rc < 0 ? -EIO : 0;
+}
+
+/* Count a cache hit on @buf. */
+static void
+bcache_hit(edfs_bcache_t *bc, edfs_buf_t *buf)
+{
+  buf->referenced = true;
+  bc->stats.hits++;
+  if (buf->prefetched)
+    {
+      buf->prefetched = false;
+      bc->stats.prefetch_hits++;
+    }
+}
+
+/* Drop clean frame @idx from the map. */
+static void
+bcache_evict(edfs_bcache_t *bc, int32_t idx)
+{
+  edfs_buf_t *buf = &bc->frames[idx];
+
+  bc->map[buf->block] = BCACHE_NONE;
+  buf->valid = false;
+  bc->stats.evictions++;
+  if (buf->prefetched)
+    bc->stats.prefetch_wasted++;
+}
+
+/* Find a frame to (re)use with the clock algorithm: skip pinned frames
+ * and give referenced frames a second chance. Returns the frame index
+ * or BCACHE_NONE if every frame is pinned.
+ */
+static int32_t
+bcache_find_victim(edfs_bcache_t *bc)
+{
+  for (size_t i = 0; i < 2 * bc->n_frames; ++i)
+    {
+      size_t idx = bc->clock_hand;
+      edfs_buf_t *buf = &bc->frames[idx];
+
+      bc->clock_hand = (bc->clock_hand + 1) % bc->n_frames;
+
+      /* Pinned frames include those reserved by a prefetch, and
+       * invalidated ones that a caller still holds.
+       */
+      if (buf->pin_count > 0)
+        continue;
+      if (!buf->valid)
+        return idx;
+      if (buf->referenced)
+        {
+          buf->referenced = false;
+          continue;
+        }
+
+      return idx;
+    }
+
+  return BCACHE_NONE;
+}
+
+
+edfs_bcache_t *
+edfs_bcache_new(edfs_io_t *io, uint16_t block_size, uint32_t n_blocks,
+                size_t n_frames)
+{
+  if (n_frames < EDFS_BCACHE_MIN_FRAMES)
+    n_frames = EDFS_BCACHE_MIN_FRAMES;
+
+  edfs_bcache_t *bc = calloc(1, sizeof(edfs_bcache_t));
+  if (!bc)
+    return NULL;
+
+  pthread_mutex_init(&bc->lock, NULL);
+  pthread_cond_init(&bc->flusher_cond, NULL);
+  pthread_cond_init(&bc->pass_cond, NULL);
+  pthread_cond_init(&bc->io_cond, NULL);
+  bc->io = io;
+  bc->block_size = block_size;
+  bc->n_blocks = n_blocks;
+  bc->n_frames = n_frames;
+
+  bc->frames = calloc(n_frames, sizeof(edfs_buf_t));
+  bc->memory = malloc(n_frames * block_size);
+  bc->map = malloc(n_blocks * sizeof(int32_t));
+  bc->flush_frames = malloc(n_frames * sizeof(edfs_buf_t *));
+  bc->flush_iov = malloc(n_frames * sizeof(struct iovec));
+  bc->flush_reqs = malloc(n_frames * sizeof(edfs_io_req_t));
+  if (!bc->frames || !bc->memory || !bc->map || !bc->flush_frames ||
+      !bc->flush_iov || !bc->flush_reqs)
+    {
+      edfs_bcache_free(bc);
+      return NULL;
+    }
+
+  for (size_t i = 0; i < n_frames; ++i)
+    bc->frames[i].data = bc->memory + i * block_size;
+
+  /* Nearly all block I/O is to and from the frames. */
+  edfs_io_register_buffer(io, bc->memory, n_frames * block_size);
+  for (uint32_t i = 0; i < n_blocks; ++i)
+    bc->map[i] = BCACHE_NONE;
+
+  edfs_bcache_set_dirty_ratio(bc, EDFS_BCACHE_DIRTY_RATIO);
+
+  return bc;
+}
+
+void
+edfs_bcache_free(edfs_bcache_t *bc)
+{
+  if (!bc)
+    return;
+
+  edfs_bcache_stop_flusher(bc);
+
+  free(bc->frames);
+  free(bc->memory);
+  free(bc->map);
+  free(bc->flush_frames);
+  free(bc->flush_iov);
+  free(bc->flush_reqs);
+  pthread_cond_destroy(&bc->flusher_cond);
+  pthread_cond_destroy(&bc->pass_cond);
+  pthread_cond_destroy(&bc->io_cond);
+  pthread_mutex_destroy(&bc->lock);
+  free(bc);
+}
+
+/* Look up or load @block; called with the lock held, which is
+ * dropped while a victim is written back or the block is read.
+ */
+static int
+bcache_get_locked(edfs_bcache_t *bc, edfs_block_t block, bool read,
+                  edfs_buf_t **bufp)
+{
+  if (block >= bc->n_blocks)
+    return -EIO;
+
+  bool missed = false;
+  edfs_buf_t *buf;
+  int32_t idx;
+
+  while (true)
+    {
+      idx = bc->map[block];
+      if (idx != BCACHE_NONE)
+        {
+          buf = &bc->frames[idx];
+
+          /* Another thread is reading it; look again afterwards, the
+           * read may have failed.
+           */
+          if (buf->loading)
+            {
+              pthread_cond_wait(&bc->io_cond, &bc->lock);
+              continue;
+            }
+
+          buf->pin_count++;
+          bcache_hit(bc, buf);
+          *bufp = buf;
+          return 0;
+        }
+
+      if (!missed)
+        bc->stats.misses++;
+      missed = true;
+
+      idx = bcache_find_victim(bc);
+      if (idx == BCACHE_NONE)
+        return -ENOBUFS;
+
+      buf = &bc->frames[idx];
+      if (!buf->valid || !buf->dirty)
+        break;
+
+      /* The victim may be used again while it is written, and the
+       * block may be loaded by someone else: start over.
+       */
+      if (bcache_writeback(bc, buf) < 0)
+        return -EIO;
+    }
+
+  if (buf->valid)
+    bcache_evict(bc, idx);
+
+  buf->block = block;
+  buf->valid = true;
+  buf->dirty = false;
+  buf->referenced = true;
+  buf->prefetched = false;
+  buf->pin_count = 1;
+  bc->map[block] = idx;
+
+  if (!read)
+    memset(buf->data, 0, bc->block_size);
+  else
+    {
+      buf->loading = true;
+      pthread_mutex_unlock(&bc->lock);
+
+      int rc = edfs_io_read(bc->io, buf->data, bc->block_size,
+                            bcache_block_offset(bc, block));
+
+      pthread_mutex_lock(&bc->lock);
+      buf->loading = false;
+      pthread_cond_broadcast(&bc->io_cond);
+      if (rc < 0)
+        {
+          bc->map[block] = BCACHE_NONE;
+          buf->valid = false;
+          buf->pin_count = 0;
+          return -EIO;
+        }
+    }
+
+  *bufp = buf;
+  return 0;
+}
+
+int
+edfs_bcache_get(edfs_bcache_t *bc, edfs_block_t block, bool read,
+                edfs_buf_t **bufp)
+{
+  pthread_mutex_lock(&bc->lock);
+  int rc = bcache_get_locked(bc, block, read, bufp);
+  pthread_mutex_unlock(&bc->lock);
+  return rc;
+}
+
+void
+edfs_bcache_put(edfs_bcache_t *bc, edfs_buf_t *buf)
+{
+  pthread_mutex_lock(&bc->lock);
+  if (buf && buf->pin_count > 0)
+    {
+      /* A flush may be waiting for it. */
+      if (--buf->pin_count == 0 && buf->dirty)
+        pthread_cond_broadcast(&bc->io_cond);
+    }
+  pthread_mutex_unlock(&bc->lock);
+}
+
+static int bcache_write_dirty (edfs_bcache_t *bc, uint64_t dirtied_before,
+                               size_t *n_busy);
+
+void
+edfs_bcache_mark_dirty(edfs_bcache_t *bc, edfs_buf_t *buf)
+{
+  pthread_mutex_lock(&bc->lock);
+  if (!buf->dirty)
+    {
+      buf->dirty = true;
+      buf->dirtied = bcache_now();
+      bc->n_dirty++;
+    }
+
+  /* Back-pressure: wait for the flusher to make a pass. Without one,
+   * or on the flusher thread itself (from its hook), write back here;
+   * frames that are pinned, such as @buf, are left for later.
+   */
+  if (bc->n_dirty > bc->dirty_limit)
+    {
+      bc->stats.throttles++;
+      if (bc->flusher_running && !pthread_equal(pthread_self(), bc->flusher))
+        {
+          uint64_t pass = bc->flusher_passes;
+
+          pthread_cond_signal(&bc->flusher_cond);
+          while (bc->flusher_running && bc->flusher_passes == pass)
+            pthread_cond_wait(&bc->pass_cond, &bc->lock);
+        }
+      else
+        {
+          size_t n_busy;
+          bcache_write_dirty(bc, UINT64_MAX, &n_busy);
+        }
+    }
+  pthread_mutex_unlock(&bc->lock);
+}
+
+int
+edfs_bcache_read(edfs_bcache_t *bc, edfs_block_t block,
+                 off_t offset, size_t len, void *dst)
+{
+  edfs_buf_t *buf;
+  int rc = edfs_bcache_get(bc, block, true, &buf);
+  if (rc < 0)
+    return rc;
+
+  memcpy(dst, buf->data + offset, len);
+  edfs_bcache_put(bc, buf);
+  return 0;
+}
+
+int
+edfs_bcache_write(edfs_bcache_t *bc, edfs_block_t block,
+                  off_t offset, size_t len, const void *src)
+{
+  /* A full block overwrite does not need the old contents. */
+  bool whole = offset == 0 && len == bc->block_size;
+
+  edfs_buf_t *buf;
+  int rc = edfs_bcache_get(bc, block, !whole, &buf);
+  if (rc < 0)
+    return rc;
+
+  memcpy(buf->data + offset, src, len);
+  edfs_bcache_mark_dirty(bc, buf);
+  edfs_bcache_put(bc, buf);
+  return 0;
+}
+
+bool
+edfs_bcache_contains(edfs_bcache_t *bc, edfs_block_t block)
+{
+  pthread_mutex_lock(&bc->lock);
+  bool res = block < bc->n_blocks && bc->map[block] != BCACHE_NONE;
+  pthread_mutex_unlock(&bc->lock);
+  return res;
+}
+
+bool
+edfs_bcache_read_cached(edfs_bcache_t *bc, edfs_block_t block,
+                        off_t offset, size_t len, void *dst)
+{
+  pthread_mutex_lock(&bc->lock);
+  if (block >= bc->n_blocks || bc->map[block] == BCACHE_NONE ||
+      bc->frames[bc->map[block]].loading)
+    {
+      pthread_mutex_unlock(&bc->lock);
+      return false;
+    }
+
+  edfs_buf_t *buf = &bc->frames[bc->map[block]];
+  bcache_hit(bc, buf);
+
+  memcpy(dst, buf->data + offset, len);
+  pthread_mutex_unlock(&bc->lock);
+  return true;
+}
+
+bool
+edfs_bcache_read_dirty(edfs_bcache_t *bc, edfs_block_t block,
+                       off_t offset, size_t len, void *dst)
+{
+  /* A frame being written back is clean already, but the image may
+   * not have its contents yet.
+   */
+  pthread_mutex_lock(&bc->lock);
+  if (block >= bc->n_blocks || bc->map[block] == BCACHE_NONE ||
+      (!bc->frames[bc->map[block]].dirty &&
+       !bc->frames[bc->map[block]].writeback))
+    {
+      pthread_mutex_unlock(&bc->lock);
+      return false;
+    }
+
+  edfs_buf_t *buf = &bc->frames[bc->map[block]];
+  bcache_hit(bc, buf);
+
+  memcpy(dst, buf->data + offset, len);
+  pthread_mutex_unlock(&bc->lock);
+  return true;
+}
+
+/* Describe a read of the consecutive blocks starting at @block into
+ * the buffers of @iov.
+ */
+static void
+bcache_req_init(edfs_bcache_t *bc, edfs_io_req_t *req, edfs_block_t block,
+                struct iovec *iov, int n)
+{
+  req->write = false;
+  req->pos = bcache_block_offset(bc, block);
+  req->iov = iov;
+  req->iovcnt = n;
+  req->res = 0;
+}
+
+int
+edfs_bcache_prefetch(edfs_bcache_t *bc, edfs_block_t block, uint32_t count)
+{
+  if ((uint32_t)block + count > bc->n_blocks)
+    return -EIO;
+  if (count == 0)
+    return 0;
+
+  int32_t       *frames = malloc(count * sizeof(int32_t));
+  struct iovec  *iov = malloc(count * sizeof(struct iovec));
+  edfs_io_req_t *reqs = malloc(count * sizeof(edfs_io_req_t));
+  if (!frames || !iov || !reqs)
+    {
+      free(frames);
+      free(iov);
+      free(reqs);
+      return -ENOMEM;
+    }
+
+  pthread_mutex_lock(&bc->lock);
+
+  /* 1. Reserve a frame for every block that is not cached. Reserved
+   *    frames are entered in the map, pinned and marked loading, so
+   *    that the clock does not hand them out twice and a get of the
+   *    block waits for the read. Each run of uncached blocks becomes
+   *    one request.
+   */
+  int          n_reqs = 0;
+  uint32_t     n = 0;                   /* frames reserved */
+  uint32_t     run = 0;                 /* ... of which in this run */
+  edfs_block_t run_start = 0;
+  int          rc = 0;
+
+  for (uint32_t i = 0; i < count; ++i)
+    {
+      edfs_block_t b = block + i;
+      int32_t idx = BCACHE_NONE;
+
+      if (bc->map[b] == BCACHE_NONE)
+        {
+          /* Read-ahead does not wait for a victim to be written. */
+          idx = bcache_find_victim(bc);
+          if (idx != BCACHE_NONE && bc->frames[idx].valid)
+            {
+              if (bc->frames[idx].dirty)
+                idx = BCACHE_NONE;
+              else
+                bcache_evict(bc, idx);
+            }
+        }
+
+      if (idx == BCACHE_NONE)
+        {
+          if (run > 0)
+            bcache_req_init(bc, &reqs[n_reqs++], run_start, &iov[n - run], run);
+          run = 0;
+
+          /* No frame to spare: read what we have. */
+          if (bc->map[b] == BCACHE_NONE)
+            break;
+          continue;
+        }
+
+      if (run == 0)
+        run_start = b;
+
+      edfs_buf_t *buf = &bc->frames[idx];
+      buf->block = b;
+      buf->valid = true;
+      buf->dirty = false;
+      buf->referenced = false;
+      buf->prefetched = true;
+      buf->loading = true;
+      buf->pin_count = 1;
+      bc->map[b] = idx;
+
+      frames[n] = idx;
+      iov[n].iov_base = bc->frames[idx].data;
+      iov[n].iov_len = bc->block_size;
+      n++;
+      run++;
+    }
+
+  if (run > 0)
+    bcache_req_init(bc, &reqs[n_reqs++], run_start, &iov[n - run], run);
+
+  /* 2. Read all runs with one batch, without the lock, then publish
+   *    the frames that were filled and drop the others.
+   */
+  pthread_mutex_unlock(&bc->lock);
+  edfs_io_run(bc->io, reqs, n_reqs);
+  pthread_mutex_lock(&bc->lock);
+
+  uint32_t f = 0;
+  for (int r = 0; r < n_reqs; ++r)
+    for (int i = 0; i < reqs[r].iovcnt; ++i, ++f)
+      {
+        edfs_buf_t *buf = &bc->frames[frames[f]];
+
+        buf->loading = false;
+        buf->pin_count = 0;
+        if (reqs[r].res < 0)
+          {
+            bc->map[buf->block] = BCACHE_NONE;
+            buf->valid = false;
+            buf->prefetched = false;
+            rc = -EIO;
+            continue;
+          }
+
+        bc->stats.prefetches++;
+      }
+
+  pthread_cond_broadcast(&bc->io_cond);
+  pthread_mutex_unlock(&bc->lock);
+
+  free(frames);
+  free(iov);
+  free(reqs);
+  return rc;
+}
+
+void
+edfs_bcache_invalidate(edfs_bcache_t *bc, edfs_block_t block)
+{
+  pthread_mutex_lock(&bc->lock);
+
+  /* A write in flight could land after one of the block's next user. */
+  while (block < bc->n_blocks && bc->map[block] != BCACHE_NONE &&
+         (bc->frames[bc->map[block]].loading ||
+          bc->frames[bc->map[block]].writeback))
+    pthread_cond_wait(&bc->io_cond, &bc->lock);
+
+  if (block < bc->n_blocks && bc->map[block] != BCACHE_NONE)
+    {
+      edfs_buf_t *buf = &bc->frames[bc->map[block]];
+      bc->map[block] = BCACHE_NONE;
+      buf->valid = false;
+      bcache_set_clean(bc, buf);
+      if (buf->prefetched)
+        bc->stats.prefetch_wasted++;
+    }
+  pthread_mutex_unlock(&bc->lock);
+}
+
+static int
+compare_frames_by_block(const void *a, const void *b)
+{
+  const edfs_buf_t *fa = *(edfs_buf_t * const *)a;
+  const edfs_buf_t *fb = *(edfs_buf_t * const *)b;
+
+  return (int)fa->block - (int)fb->block;
+}
+
+/* Write back the unpinned dirty frames that became dirty before
+ * @dirtied_before (in ms; UINT64_MAX for all), with the lock held.
+ * The frames are collected and pinned under the lock, which is
+ * dropped for the writes. The number of frames that were left alone
+ * because they are pinned, or being written by someone else, is
+ * stored in *n_busy. Returns the number of frames written or -EIO.
+ *
+ * A frame cannot be invalidated while it is written (see
+ * edfs_bcache_invalidate()); it may be modified by its owner, and is
+ * then dirty again afterwards.
+ */
+static int
+bcache_write_dirty(edfs_bcache_t *bc, uint64_t dirtied_before,
+                   size_t *n_busy)
+{
+  edfs_buf_t   **dirty = bc->flush_frames;
+  struct iovec  *iov = bc->flush_iov;
+  edfs_io_req_t *reqs = bc->flush_reqs;
+
+  while (bc->flush_active)
+    pthread_cond_wait(&bc->io_cond, &bc->lock);
+
+  size_t n_dirty = 0;
+  *n_busy = 0;
+  for (size_t i = 0; i < bc->n_frames; ++i)
+    {
+      edfs_buf_t *buf = &bc->frames[i];
+
+      if (buf->writeback || (buf->dirty && buf->pin_count > 0))
+        (*n_busy)++;
+      else if (buf->valid && buf->dirty && buf->dirtied < dirtied_before)
+        dirty[n_dirty++] = buf;
+    }
+
+  if (n_dirty == 0)
+    return 0;
+
+  /* Writing in block order keeps the image writes sequential. Frames
+   * of consecutive blocks are written by one request, and all requests
+   * are submitted as one batch.
+   */
+  qsort(dirty, n_dirty, sizeof(edfs_buf_t *), compare_frames_by_block);
+
+  int n_reqs = 0;
+  for (size_t i = 0; i < n_dirty; ++i)
+    {
+      iov[i].iov_base = dirty[i]->data;
+      iov[i].iov_len = bc->block_size;
+
+      if (i > 0 && dirty[i]->block == dirty[i - 1]->block + 1)
+        {
+          reqs[n_reqs - 1].iovcnt++;
+          continue;
+        }
+
+      reqs[n_reqs].write = true;
+      reqs[n_reqs].pos = bcache_block_offset(bc, dirty[i]->block);
+      reqs[n_reqs].iov = &iov[i];
+      reqs[n_reqs].iovcnt = 1;
+      n_reqs++;
+    }
+
+  for (size_t i = 0; i < n_dirty; ++i)
+    bcache_begin_writeback(bc, dirty[i]);
+  bc->flush_active = true;
+  pthread_mutex_unlock(&bc->lock);
+
+  int res = edfs_io_run(bc->io, reqs, n_reqs);
+
+  pthread_mutex_lock(&bc->lock);
+  size_t f = 0;
+  for (int r = 0; r < n_reqs; ++r)
+    for (int i = 0; i < reqs[r].iovcnt; ++i, ++f)
+      bcache_end_writeback(bc, dirty[f], reqs[r].res == 0);
+
+  bc->flush_active = false;
+  pthread_cond_broadcast(&bc->io_cond);
+
+  return res < 0 ? -EIO : (int)n_dirty;
+}
+
+int
+edfs_bcache_flush(edfs_bcache_t *bc)
+{
+  if (!bc)
+    return 0;
+
+  /* Pinned frames are written in a later round, once they have been
+   * put, and write-backs by others are waited for. Without any writes
+   * of its own a round kept the lock throughout, so that a put or the
+   * end of an I/O cannot be missed.
+   */
+  int res = 0;
+  pthread_mutex_lock(&bc->lock);
+  while (true)
+    {
+      size_t n_busy;
+      int n = bcache_write_dirty(bc, UINT64_MAX, &n_busy);
+      if (n < 0)
+        res = -EIO;
+      if (n_busy == 0)
+        break;
+      if (n == 0)
+        pthread_cond_wait(&bc->io_cond, &bc->lock);
+    }
+  pthread_mutex_unlock(&bc->lock);
+
+  return res;
+}
+
+void
+edfs_bcache_set_dirty_ratio(edfs_bcache_t *bc, unsigned percent)
+{
+  if (percent < 1)
+    percent = 1;
+  if (percent > 100)
+    percent = 100;
+
+  pthread_mutex_lock(&bc->lock);
+  bc->dirty_limit = bc->n_frames * percent / 100;
+  if (bc->dirty_limit < 1)
+    bc->dirty_limit = 1;
+  pthread_mutex_unlock(&bc->lock);
+}
+
+static void *
+bcache_flusher_thread(void *data)
+{
+  edfs_bcache_t *bc = data;
+  uint64_t hook_run = bcache_now();
+
+  pthread_mutex_lock(&bc->lock);
+  while (!bc->flusher_stop)
+    {
+      struct timespec ts;
+      clock_gettime(CLOCK_REALTIME, &ts);
+      ts.tv_sec += EDFS_BCACHE_FLUSH_INTERVAL;
+      if (bc->n_dirty <= bc->dirty_limit / 2)
+        pthread_cond_timedwait(&bc->flusher_cond, &bc->lock, &ts);
+      if (bc->flusher_stop)
+        break;
+
+      if (bc->flush_hook &&
+          bcache_now() - hook_run >= EDFS_BCACHE_FLUSH_INTERVAL * 1000)
+        {
+          edfs_bcache_flush_fn fn = bc->flush_hook;
+          void *userdata = bc->flush_hook_data;
+
+          hook_run = bcache_now();
+          pthread_mutex_unlock(&bc->lock);
+          fn(userdata);
+          pthread_mutex_lock(&bc->lock);
+        }
+
+      /* Above the background threshold everything goes, otherwise
+       * only what has been dirty for long enough.
+       */
+      uint64_t before = UINT64_MAX;
+      if (bc->n_dirty <= bc->dirty_limit / 2)
+        before = bcache_now() - EDFS_BCACHE_DIRTY_EXPIRE * 1000;
+
+      size_t n_busy;
+      int n = bcache_write_dirty(bc, before, &n_busy);
+      if (n > 0)
+        bc->stats.flusher_writes += n;
+
+      bc->flusher_passes++;
+      pthread_cond_broadcast(&bc->pass_cond);
+
+      /* Do not spin on frames that stay pinned. */
+      if (n <= 0 && bc->n_dirty > bc->dirty_limit / 2)
+        {
+          pthread_mutex_unlock(&bc->lock);
+          sched_yield();
+          pthread_mutex_lock(&bc->lock);
+        }
+    }
+  pthread_mutex_unlock(&bc->lock);
+
+  return NULL;
+}
+
+void
+edfs_bcache_set_flush_hook(edfs_bcache_t *bc, edfs_bcache_flush_fn fn,
+                           void *userdata)
+{
+  pthread_mutex_lock(&bc->lock);
+  bc->flush_hook = fn;
+  bc->flush_hook_data = userdata;
+  pthread_mutex_unlock(&bc->lock);
+}
+
+int
+edfs_bcache_start_flusher(edfs_bcache_t *bc)
+{
+  pthread_mutex_lock(&bc->lock);
+  bc->flusher_stop = false;
+  int rc = pthread_create(&bc->flusher, NULL, bcache_flusher_thread, bc);
+  bc->flusher_running = rc == 0;
+  pthread_mutex_unlock(&bc->lock);
+
+  return -rc;
+}
+
+void
+edfs_bcache_stop_flusher(edfs_bcache_t *bc)
+{
+  pthread_mutex_lock(&bc->lock);
+  if (!bc->flusher_running)
+    {
+      pthread_mutex_unlock(&bc->lock);
+      return;
+    }
+  bc->flusher_stop = true;
+  pthread_cond_signal(&bc->flusher_cond);
+  pthread_mutex_unlock(&bc->lock);
+
+  pthread_join(bc->flusher, NULL);
+
+  /* Release writers waiting for a pass. */
+  pthread_mutex_lock(&bc->lock);
+  bc->flusher_running = false;
+  pthread_cond_broadcast(&bc->pass_cond);
+  pthread_mutex_unlock(&bc->lock);
+}
+
+void
+edfs_bcache_get_stats(edfs_bcache_t *bc, edfs_bcache_stats_t *stats)
+{
+  if (!bc)
+    {
+      memset(stats, 0, sizeof(edfs_bcache_stats_t));
+      return;
+    }
+
+  pthread_mutex_lock(&bc->lock);
+  *stats = bc->stats;
+  pthread_mutex_unlock(&bc->lock);
+}
+
+void
+edfs_bcache_print_stats(edfs_bcache_t *bc, FILE *out)
+{
+  edfs_bcache_stats_t s;
+  edfs_bcache_get_stats(bc, &s);
+
+  uint64_t lookups = s.hits + s.misses;
+  fprintf(out, "bcache: %llu hits, %llu misses (%.1f%% hit rate), "
+          "%llu evictions, %llu writebacks\n",
+          (unsigned long long)s.hits, (unsigned long long)s.misses,
+          lookups ? 100.0 * s.hits / lookups : 0.0,
+          (unsigned long long)s.evictions, (unsigned long long)s.writebacks);
+  fprintf(out, "bcache: %llu blocks read ahead, %llu used, %llu wasted\n",
+          (unsigned long long)s.prefetches,
+          (unsigned long long)s.prefetch_hits,
+          (unsigned long long)s.prefetch_wasted);
+  fprintf(out, "bcache: %llu blocks written by the flusher, "
+          "%llu writers held at the dirty limit\n",
+          (unsigned long long)s.flusher_writes,
+          (unsigned long long)s.throttles);
+}
@@ -0,0 +1,186 @@
+/* EdFS -- An educational file system
+ *
+ * Copyright (C) 2019  Leiden University, The Netherlands.
+ */
+
+#ifndef __EDFS_BCACHE_H__
+#define __EDFS_BCACHE_H__
+
+#include "edfs.h"
+#include "edfs-io.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+
+/*
+ * Block buffer cache
+ *
+ * A fixed number of block-sized frames, indexed by disk block number.
+ * A frame is pinned while a caller holds it (edfs_bcache_get() ..
+ * edfs_bcache_put()); unpinned frames are replaced using the clock
+ * algorithm. Modified frames are written back on eviction and by
+ * edfs_bcache_flush().
+ *
+ * Modified frames are counted. A flusher thread, once started, writes
+ * back frames that have been dirty for longer than
+ * EDFS_BCACHE_DIRTY_EXPIRE seconds, and all of them when more than
+ * half of the dirty limit is in use. The dirty limit caps the number
+ * of dirty frames: a writer that goes over it waits for a flusher
+ * pass, or writes back itself when there is no flusher.
+ *
+ * The cache may be used from several threads. Reads and writes of the
+ * image are done without the cache lock; the frame is pinned and
+ * marked loading or writeback meanwhile, and others that need it wait
+ * for the I/O to finish. The cache does not serialise access to the
+ * contents of a frame: callers modifying a block must own it, e.g. by
+ * holding the lock of the inode it belongs to, and must keep the frame
+ * pinned while doing so.
+ */
+
+/* Default and minimum number of frames. Callers pin at most a few
+ * frames at a time, the minimum leaves room for that.
+ */
+#define EDFS_BCACHE_N_FRAMES   1024
+#define EDFS_BCACHE_MIN_FRAMES 8
+
+/* Write-back: default dirty limit in percent of the frames, age after
+ * which a dirty frame is written back and flusher wake-up interval.
+ */
+#define EDFS_BCACHE_DIRTY_RATIO     50
+#define EDFS_BCACHE_DIRTY_EXPIRE    5
+#define EDFS_BCACHE_FLUSH_INTERVAL  1
+
+typedef struct
+{
+  edfs_block_t block;
+  bool         valid;
+  bool         dirty;
+  bool         referenced;
+  bool         prefetched;   /* loaded by read-ahead, not used yet */
+  bool         loading;      /* being read, contents not there yet */
+  bool         writeback;    /* being written back */
+  uint32_t     pin_count;
+  uint64_t     dirtied;      /* when it became dirty, in ms */
+  uint8_t     *data;
+} edfs_buf_t;
+
+typedef struct
+{
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+  uint64_t writebacks;
+  uint64_t prefetches;       /* blocks loaded by read-ahead */
+  uint64_t prefetch_hits;    /* ... that were used afterwards */
+  uint64_t prefetch_wasted;  /* ... that were dropped unused */
+  uint64_t flusher_writes;   /* blocks written by the flusher */
+  uint64_t throttles;        /* writers held at the dirty limit */
+} edfs_bcache_stats_t;
+
+typedef struct _edfs_bcache edfs_bcache_t;
+
+
+edfs_bcache_t *edfs_bcache_new            (edfs_io_t      *io,
+                                           uint16_t        block_size,
+                                           uint32_t        n_blocks,
+                                           size_t          n_frames);
+void           edfs_bcache_free           (edfs_bcache_t  *bcache);
+
+/* Pin the frame for @block and return it in *buf. When the block is not
+ * cached yet its contents are read from the image if @read is true, or
+ * zero-filled otherwise (for blocks about to be overwritten completely).
+ * Returns 0 on success or a negative errno.
+ */
+int            edfs_bcache_get            (edfs_bcache_t  *bcache,
+                                           edfs_block_t    block,
+                                           bool            read,
+                                           edfs_buf_t    **buf);
+void           edfs_bcache_put            (edfs_bcache_t  *bcache,
+                                           edfs_buf_t     *buf);
+void           edfs_bcache_mark_dirty     (edfs_bcache_t  *bcache,
+                                           edfs_buf_t     *buf);
+
+/* Copy helpers for partial block access through the cache. */
+int            edfs_bcache_read           (edfs_bcache_t  *bcache,
+                                           edfs_block_t    block,
+                                           off_t           offset,
+                                           size_t          len,
+                                           void           *dst);
+int            edfs_bcache_write          (edfs_bcache_t  *bcache,
+                                           edfs_block_t    block,
+                                           off_t           offset,
+                                           size_t          len,
+                                           const void     *src);
+
+/* Whether @block currently has a frame. */
+bool           edfs_bcache_contains       (edfs_bcache_t  *bcache,
+                                           edfs_block_t    block);
+
+/* Copy from @block only if it is cached; does not load it on a miss.
+ * Returns true when the data was copied.
+ */
+bool           edfs_bcache_read_cached    (edfs_bcache_t  *bcache,
+                                           edfs_block_t    block,
+                                           off_t           offset,
+                                           size_t          len,
+                                           void           *dst);
+
+/* Like edfs_bcache_read_cached(), but only copies when the frame of
+ * @block holds modifications that are not on the image yet: it is
+ * dirty or being written back.
+ */
+bool           edfs_bcache_read_dirty     (edfs_bcache_t  *bcache,
+                                           edfs_block_t    block,
+                                           off_t           offset,
+                                           size_t          len,
+                                           void           *dst);
+
+/* Load the @count blocks starting at @block, which are consecutive on
+ * the image, into the cache for read-ahead. Blocks that are cached
+ * already are left alone; the others are read with one vectored read
+ * per run, without holding the cache lock.
+ * The frames are not pinned and are the first to be replaced if they
+ * are not used. Returns 0 on success or a negative errno.
+ */
+int            edfs_bcache_prefetch       (edfs_bcache_t  *bcache,
+                                           edfs_block_t    block,
+                                           uint32_t        count);
+
+/* Forget @block without writing it back, e.g. after it was freed. */
+void           edfs_bcache_invalidate     (edfs_bcache_t  *bcache,
+                                           edfs_block_t    block);
+
+/* Write all dirty frames back, in block order. Frames that are
+ * pinned are waited for.
+ */
+int            edfs_bcache_flush          (edfs_bcache_t  *bcache);
+
+/* Allow at most @percent of the frames to be dirty (1 .. 100). */
+void           edfs_bcache_set_dirty_ratio (edfs_bcache_t *bcache,
+                                            unsigned       percent);
+
+/* Start or stop the flusher thread. Starting returns 0 or a negative
+ * errno; the cache then keeps working without it.
+ */
+int            edfs_bcache_start_flusher  (edfs_bcache_t  *bcache);
+void           edfs_bcache_stop_flusher   (edfs_bcache_t  *bcache);
+
+/* Called by the flusher thread about every EDFS_BCACHE_FLUSH_INTERVAL
+ * seconds, without the cache lock, so that data kept outside the
+ * cache can be written back by age as well.
+ */
+typedef void (*edfs_bcache_flush_fn)(void *userdata);
+
+void           edfs_bcache_set_flush_hook (edfs_bcache_t        *bcache,
+                                           edfs_bcache_flush_fn  fn,
+                                           void                 *userdata);
+
+void           edfs_bcache_get_stats      (edfs_bcache_t       *bcache,
+                                           edfs_bcache_stats_t *stats);
+void           edfs_bcache_print_stats    (edfs_bcache_t  *bcache,
+                                           FILE           *out);
+
+#endif /* __EDFS_BCACHE_H__ */
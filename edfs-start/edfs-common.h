@@ -7,25 +7,173 @@
  #define __EDFS_COMMON_H__
  
  #include "edfs.h"
+ #include "edfs-dcache.h"
+ #include "edfs-bcache.h"
+ #include "edfs-io.h"
  
  #include <stdint.h>
  #include <stdbool.h>
+ #include <stdio.h>
+ #include <time.h>
  #include <unistd.h>
+ #include <pthread.h>
  
  
+ /* Tunables for edfs_image_open(); pass NULL to use the defaults. */
+ typedef struct
+ {
+   size_t cache_blocks;           /* frames in the block cache */
+   edfs_io_backend_t io_backend;  /* how the image is accessed */
+   unsigned dirty_ratio;          /* dirty limit, % of the block cache */
+ } edfs_image_options_t;
+ 
+ /* Decoded indirect block pointers of a recently used inode: map[i] is
+  * the disk block holding logical block i. Slot s of the inode is
+  * loaded when ind_blocks[s] equals the inode's block pointer s.
+  * A pinned entry (an open file) is not taken over by other inodes.
+  */
+ typedef struct
+ {
+   edfs_inumber_t inumber;                          /* 0: unused */
+   edfs_block_t   ind_blocks[EDFS_INODE_N_BLOCKS];
+   edfs_block_t  *map;
+   uint32_t       pin_count;
+ } edfs_block_map_t;
+ 
+ /* Number of inodes for which a block map is kept. */
+ #define EDFS_BLOCK_MAP_N_ENTRIES 32
+
+ /* Index of the entries of a recently used directory, built on first
+  * use. Slot s is entry s % (entries per block) of the directory's
+  * block pointer s / (entries per block). Used slots are chained per
+  * hash bucket; free slots in the blocks the directory has are on the
+  * free list. Both chains run through next.
+  */
+ typedef struct
+ {
+   edfs_inumber_t inumber;                /* 0: free */
+   uint32_t       hash;
+   int32_t        next;
+   char           name[EDFS_FILENAME_SIZE];
+ } edfs_dir_index_slot_t;
+
+ typedef struct
+ {
+   edfs_inumber_t         inumber;       /* directory; 0: unused */
+   uint32_t               n_used;
+   int32_t                free_list;     /* -1: no free slot */
+   int32_t               *buckets;
+   edfs_dir_index_slot_t *slots;
+ } edfs_dir_index_t;
+
+ /* Number of directories for which an index is kept. */
+ #define EDFS_DIR_INDEX_N_ENTRIES 32
+ 
  /* Structure to use as handle to an opened image file. */
  typedef struct
  {
    int fd;
    const char *filename;
+   edfs_io_t *io;
  
    edfs_super_block_t sb;
+ 
+   edfs_dcache_t *dcache;
+   edfs_bcache_t *bcache;
+ 
+   /* In-memory copy of the inode table. Modified inodes are written
+    * back in chunks of EDFS_ITABLE_CHUNK_SIZE bytes by
+    * edfs_flush_inodes(). With the mmap backend (itable_mapped) this
+    * is the table in the mapped image.
+    */
+   edfs_disk_inode_t *itable;
+   bool               itable_mapped;
+   bool              *itable_dirty;        /* one flag per chunk */
+   uint32_t           itable_n_chunks;
+   time_t             itable_dirty_since;  /* 0 when all clean */
+ 
+   /* Index of allocated inodes, one bit per inode (set: in use or
+    * handed out by edfs_new_inode). No inode below inode_free_hint is
+    * free.
+    */
+   uint64_t          *inode_used;
+   edfs_inumber_t     inode_free_hint;
+
+   /* Per inode, where to place its first block: after the blocks of
+    * the directory it was added to. EDFS_BLOCK_INVALID when unknown.
+    */
+   edfs_block_t      *inode_goal;
+ 
+   /* In-memory copy of the free-block bitmap; bit b of the bitmap is
+    * bit b % 64 of word b / 64 (the image is little-endian). Modified
+    * chunks are written back by edfs_flush_bitmap(). Like the inode
+    * table, it may be used in place in the mapped image.
+    */
+   uint64_t          *bitmap;
+   bool               bitmap_mapped;
+   bool              *bitmap_dirty;        /* one flag per chunk */
+   uint32_t           bitmap_n_chunks;
+   time_t             bitmap_dirty_since;  /* 0 when all clean */
+   uint32_t           bitmap_cursor;       /* next-fit allocation start */
+   uint32_t           n_free_blocks;
+   uint32_t           n_reserved_blocks;   /* promised to delayed writes */
+ 
+   /* Block maps, direct-mapped by inumber. */
+   edfs_block_map_t   block_maps[EDFS_BLOCK_MAP_N_ENTRIES];
+
+   /* Directory indexes, direct-mapped by inumber likewise. */
+   edfs_dir_index_t   dir_indexes[EDFS_DIR_INDEX_N_ENTRIES];
+
+   /* Locks for multithreaded mounts: itable_lock covers the inode
+    * table and its index, bitmap_lock the bitmap (the block
+    * allocator), block_map_lock the block maps and dir_index_lock the
+    * directory indexes. The super block is never modified once
+    * mounted; sync_lock makes edfs_image_sync() calls run one at a
+    * time. The caches lock themselves. File data, indirect blocks and
+    * directory contents are protected by the callers' per-inode locks
+    * (see edfuse.c).
+    */
+   pthread_mutex_t    itable_lock;
+   pthread_mutex_t    bitmap_lock;
+   pthread_mutex_t    block_map_lock;
+   pthread_mutex_t    dir_index_lock;
+   pthread_mutex_t    sync_lock;
+ 
+   struct
+   {
+     uint64_t inode_writes;     /* writes of the inode table */
+     uint64_t bitmap_writes;    /* writes of the bitmap */
+     uint64_t alloc_extents;    /* successful allocator calls */
+     uint64_t alloc_blocks;     /* ... and the blocks they returned */
+     uint64_t block_map_loads;  /* indirect blocks decoded */
+     uint64_t dir_lookups;      /* names looked up in a directory index */
+     uint64_t dir_index_builds; /* directories read to build one */
+     uint64_t data_reads;       /* reads of uncached file data */
+     uint64_t data_writes;      /* writes of whole data blocks */
+     uint64_t data_refs;        /* image extents handed out uncopied */
+     uint64_t delalloc_blocks;  /* blocks placed by delayed allocation */
+     uint64_t delalloc_runs;    /* ... in this many flushes */
+   } stats;
  } edfs_image_t;
  
+ /* Granularity of inode table and bitmap write-back, in bytes. */
+ #define EDFS_ITABLE_CHUNK_SIZE 4096
+ #define EDFS_BITMAP_CHUNK_SIZE 512
+ 
+ /* Dirty inodes are written back once they have been modified for
+  * this many seconds, see edfs_image_writeback().
+  */
+ #define EDFS_WRITEBACK_INTERVAL 5
+ 
  
  void           edfs_image_close           (edfs_image_t *img);
  edfs_image_t  *edfs_image_open            (const char   *filename,
-                                            bool          read_super);
+                                            bool          read_super,
+                                            const edfs_image_options_t *opts);
+ void           edfs_image_print_stats     (edfs_image_t *img,
+                                            FILE         *out);
+ int            edfs_image_sync            (edfs_image_t *img);
+ int            edfs_image_writeback       (edfs_image_t *img);
  
  
  
@@ -41,6 +189,9 @@
  {
    edfs_inumber_t inumber;
    edfs_disk_inode_t inode;
+   uint32_t n_reserved;   /* reserved blocks its allocations may use,
+                           * see edfs_reserve_blocks()
+                           */
  } edfs_inode_t;
  
  
@@ -65,8 +216,10 @@
  * ------------------------------------------------------------- */
 
 /* Translate a file offset to:
- *   – the disk block number that holds the data
+ *   – the disk block number that holds the data, or
+ *     EDFS_BLOCK_INVALID for a hole that reads as zeroes
  *   – the offset inside that block
+ * Indirect blocks are decoded once into a cached block map.
  * Returns 0 on success, negative errno on error.                 */
  int edfs_block_for_offset(edfs_image_t       *img,
                            const edfs_inode_t *inode,
@@ -74,46 +227,342 @@
                            edfs_block_t       *block_out,
                            off_t              *inblock_off);
 
+/* Count the extents of @inode: runs of physically contiguous data
+ * blocks, holes not included. A measure of fragmentation; an
+ * unfragmented file has one. Returns 0 on success, negative errno on
+ * error.
+ */
+ int edfs_count_extents(edfs_image_t       *img,
+                        const edfs_inode_t *inode,
+                        uint32_t           *n_extents);
+
+/* Read up to @size bytes of file @inode at @offset into @buf. Blocks
+ * that are not in the block cache are read directly from the image,
+ * one read per run of physically contiguous blocks. Returns the
+ * number of bytes read (short at end of file) or a negative errno.
+ */
+ ssize_t edfs_read_data(edfs_image_t       *img,
+                        const edfs_inode_t *inode,
+                        off_t               offset,
+                        size_t              size,
+                        char               *buf);
+
+/* A piece of file data handed out by edfs_map_data(): @len bytes of
+ * the image at @pos, or, when @mem is set, @len bytes at @mem.
+ */
+typedef struct
+{
+  off_t       pos;
+  size_t      len;
+  const char *mem;
+} edfs_data_ref_t;
+
+/* Describe the data of a read like edfs_read_data() without copying
+ * it where possible: clean data is referred to by its image offset,
+ * and only holes and blocks that are dirty in the block cache are
+ * copied into @scratch (@size bytes). Adjacent pieces are merged.
+ * @refs must have room for @size / block_size + 2 entries; the number
+ * used is stored in *n_refs. The references stay valid while the
+ * inode is locked. Returns the number of bytes described or a
+ * negative errno.
+ */
+ ssize_t edfs_map_data(edfs_image_t       *img,
+                       const edfs_inode_t *inode,
+                       off_t               offset,
+                       size_t              size,
+                       char               *scratch,
+                       edfs_data_ref_t    *refs,
+                       int                *n_refs);
+
+/* Load data blocks #first .. #first + count - 1 of file @inode into
+ * the block cache, one read per run of physically contiguous blocks
+ * that are not cached yet. Holes are skipped. Returns 0 on success or
+ * a negative errno.
+ */
+ int edfs_readahead(edfs_image_t       *img,
+                    const edfs_inode_t *inode,
+                    uint32_t            first,
+                    uint32_t            count);
+
+/* Requests covering at least this many blocks write their whole,
+ * uncached blocks directly to the image. Smaller writes go through the
+ * block cache, so that repeated small writes are merged there.
+ */
+#define EDFS_WRITE_DIRECT_BLOCKS 8
+
+/* Write @size bytes from @buf to file @inode at @offset, extending the
+ * file when needed. All blocks of the request are allocated up front
+ * and the inode is written once. In large requests, whole blocks that
+ * are not cached are written directly, one write per physically
+ * contiguous run; the rest goes through the block cache. Returns
+ * @size or a negative errno.
+ */
+ ssize_t edfs_write_data(edfs_image_t *img,
+                         edfs_inode_t *inode,
+                         off_t         offset,
+                         size_t        size,
+                         const char   *buf);
+
+/* Moves the next @len bytes of the data of edfs_write_data_from() to
+ * @dst, or, when @dst is NULL, to the image at offset @pos. Returns 0
+ * on success or a negative errno.
+ */
+typedef int (*edfs_write_source_fn)(void   *userdata,
+                                    char   *dst,
+                                    off_t   pos,
+                                    size_t  len);
+
+/* Like edfs_write_data(), but the data comes from @fn, which is asked
+ * for it in order. Runs of whole uncached blocks are handed to @fn
+ * with their image offset, so that it can move them there without a
+ * copy through memory.
+ */
+ ssize_t edfs_write_data_from(edfs_image_t         *img,
+                              edfs_inode_t         *inode,
+                              off_t                 offset,
+                              size_t                size,
+                              edfs_write_source_fn  fn,
+                              void                 *userdata);
+
+/* Delayed allocation
+ *
+ * Small writes to blocks that do not exist yet, typically appends, can
+ * be held back in an edfs_delalloc_t kept with the open file. Only the
+ * number of blocks is reserved, including the indirect blocks the
+ * range will need, so that a write that is accepted can be placed;
+ * the blocks are allocated when the data is flushed, all at once, so
+ * that they are consecutive on disk even when several files grow at
+ * the same time. The data held covers one range of at most
+ * EDFS_DELALLOC_MAX_BLOCKS logical blocks, and is written by the
+ * owner once it has been held for EDFS_WRITEBACK_INTERVAL seconds
+ * (see edfs_delalloc_expired()). Writes of EDFS_DELALLOC_MAX_WRITE
+ * blocks or more allocate their blocks together anyway and are not
+ * held.
+ *
+ * While data is held, the in-memory inode has the new size but the
+ * inode table does not: the inode must be written only through
+ * edfs_delalloc_flush(), and the owner must flush before any other
+ * change to the inode. To drop the data instead, the owner calls
+ * edfs_delalloc_destroy() and takes the size back from the inode
+ * table. Like the inode, an edfs_delalloc_t is protected by the
+ * caller's inode lock.
+ */
+#define EDFS_DELALLOC_MAX_BLOCKS 64
+#define EDFS_DELALLOC_MAX_WRITE  8
+
+typedef struct
+{
+  uint32_t  first;        /* logical block of data[0] */
+  uint32_t  count;        /* blocks held; 0: none */
+  uint32_t  n_reserved;   /* blocks reserved for them */
+  time_t    since;        /* when the first of them was held */
+  uint8_t  *data;         /* EDFS_DELALLOC_MAX_BLOCKS blocks */
+} edfs_delalloc_t;
+
+ void edfs_delalloc_init(edfs_delalloc_t *da);
+
+/* Drop the data held without writing it, e.g. for a removed file,
+ * and free the buffer.
+ */
+ void edfs_delalloc_destroy(edfs_image_t    *img,
+                            edfs_delalloc_t *da);
+
+/* Allocate blocks for the data held and write it. Returns 0 on
+ * success or a negative errno; the data and its reservation are then
+ * still held, for a later attempt.
+ */
+ int edfs_delalloc_flush(edfs_image_t    *img,
+                         edfs_inode_t    *inode,
+                         edfs_delalloc_t *da);
+
+/* Whether @da holds data for EDFS_WRITEBACK_INTERVAL seconds or more. */
+ bool edfs_delalloc_expired(const edfs_delalloc_t *da);
+
+/* Write like edfs_write_data(), but hold the data in @da when the
+ * write is small, only touches blocks that are not allocated and fits
+ * in with the range held. Otherwise @da is flushed first.
+ */
+ ssize_t edfs_write_delayed(edfs_image_t    *img,
+                            edfs_inode_t    *inode,
+                            edfs_delalloc_t *da,
+                            off_t            offset,
+                            size_t           size,
+                            const char      *buf);
+
+/* Copy the data held in @da that falls in [@offset, @offset + @size)
+ * over @buf, which holds that range as read from the image.
+ */
+ void edfs_delalloc_read(edfs_image_t          *img,
+                         const edfs_delalloc_t *da,
+                         off_t                  offset,
+                         size_t                 size,
+                         char                  *buf);
+
+/* Set the size of file @inode to @new_size, allocating blocks with
+ * edfs_allocate_data() when growing and freeing blocks past the end
+ * when shrinking. Bytes beyond the old end read back as zeroes.
+ * Returns 0 on success or a negative errno.
+ */
+ int edfs_truncate_data(edfs_image_t *img,
+                        edfs_inode_t *inode,
+                        off_t         new_size);
+
+/* Allocate the blocks for [@offset, @offset + @len) of file @inode,
+ * and between its end and @offset, that do not exist yet, with as few
+ * allocator calls as the free space allows, and zero them. Grows the
+ * file to cover the range. Returns 0 on success or a negative errno.
+ */
+ int edfs_allocate_data(edfs_image_t *img,
+                        edfs_inode_t *inode,
+                        off_t         offset,
+                        off_t         len);
+
  int            edfs_read_inode            (edfs_image_t *img,
                                             edfs_inode_t *inode);
  int            edfs_read_root_inode       (edfs_image_t *img,
                                             edfs_inode_t *inode);
  int            edfs_write_inode           (edfs_image_t *img,
                                             edfs_inode_t *inode);
+ int            edfs_flush_inodes          (edfs_image_t *img);
  int            edfs_clear_inode           (edfs_image_t *img,
                                             edfs_inode_t *inode);
  edfs_inumber_t edfs_find_free_inode       (edfs_image_t *img);
  int            edfs_new_inode             (edfs_image_t *img,
                                             edfs_inode_t *inode,
                                             edfs_inode_type_t type);
+
+/* Set EDFS_INODE_FLAG_ORPHAN on @inode, which was removed from its
+ * directory, and write it.
+ */
+ int            edfs_orphan_inode          (edfs_image_t *img,
+                                            edfs_inode_t *inode);
  /* ------------------------------------------------------------- *
  *  Block allocation helpers                                      *
  * ------------------------------------------------------------- */
 
-/* Allocate one free disk block, mark it in the bitmap,
- * return 0-based block number in *block_out.
- * Returns 0 on success, negative errno on failure.               */
-int edfs_alloc_block(edfs_image_t *img, edfs_block_t *block_out);
+/* Allocate one free disk block as close to @goal as possible, mark
+ * it in the bitmap, return 0-based block number in *block_out. A
+ * @goal of EDFS_BLOCK_INVALID continues after the previous
+ * allocation. Returns 0 on success, negative errno on failure.   */
+int edfs_alloc_block(edfs_image_t *img, edfs_block_t goal,
+                     edfs_block_t *block_out);
+
+/* Allocate between @min_len and @max_len free blocks that are
+ * consecutive on disk, with one search of the bitmap outward from
+ * @goal and one update of it: the nearest free run of @max_len
+ * blocks, or else the longest free run. Stores the extent in *start
+ * and *len. Returns 0 on success, -ENOSPC when no free run of
+ * @min_len blocks exists, or another negative errno.             */
+int edfs_alloc_extent(edfs_image_t *img, edfs_block_t goal,
+                      uint32_t min_len, uint32_t max_len,
+                      edfs_block_t *start, uint32_t *len);
 
 /* Mark @block as free again in the bitmap.                       */
 int edfs_free_block(edfs_image_t *img, edfs_block_t block);
 
+/* Mark the @n blocks in @blocks as free again, with one update of the
+ * in-memory bitmap per run of consecutive blocks; every bitmap chunk
+ * that changes is written back once, later. Sorts @blocks. Blocks
+ * that were free already are reported with -ENOENT, after the others
+ * have been freed.                                               */
+int edfs_free_blocks(edfs_image_t *img, edfs_block_t *blocks, uint32_t n);
+
+/* Set aside @count free blocks for data that has not been placed
+ * yet; ordinary allocations leave them alone. Returns 0 or -ENOSPC.
+ * edfs_unreserve_blocks() returns them.                          */
+int  edfs_reserve_blocks(edfs_image_t *img, uint32_t count);
+void edfs_unreserve_blocks(edfs_image_t *img, uint32_t count);
+
+/* Write modified parts of the bitmap back to the image.          */
+int edfs_flush_bitmap(edfs_image_t *img);
+
 /* ------------------------------------------------------------- *
  *  Directory-entry helper                                         *
  * ------------------------------------------------------------- */
 
-/* Insert a new entry (name + inumber) into the directory inode.
- * Allocates a new data block for the dir when current blocks are full.
- * Returns 0 on success or negative errno.                         */
+/* Where an entry of a directory is.                               */
+typedef struct
+{
+  edfs_inumber_t inumber;       /* inode the entry refers to */
+  edfs_block_t   block;         /* directory block holding it */
+  uint32_t       slot;          /* its number in the directory */
+} edfs_dir_pos_t;
+
+/* Look up @name in directory @dir_inode and, when it is not there,
+ * reserve a free slot for it, all in one pass over the directory's
+ * index. A new block is added to the directory (and the inode
+ * written) when its blocks are full. Returns 0 with the reserved
+ * slot in *pos (pos->inumber is 0), -EEXIST with pos->inumber set to
+ * the existing entry, or another negative errno. The reservation
+ * must be completed with edfs_dir_commit() or edfs_dir_cancel();
+ * until then the caller must keep others from changing the
+ * directory.                                                      */
+int edfs_dir_lookup_or_reserve(edfs_image_t   *img,
+                               edfs_inode_t   *dir_inode,
+                               const char     *name,
+                               edfs_dir_pos_t *pos);
+
+/* Fill in the slot reserved at @pos with @name and @inumber. On
+ * failure the reservation is cancelled. Returns 0 or a negative
+ * errno.                                                          */
+int  edfs_dir_commit(edfs_image_t         *img,
+                     const edfs_inode_t   *dir_inode,
+                     const edfs_dir_pos_t *pos,
+                     const char           *name,
+                     edfs_inumber_t        inumber);
+void edfs_dir_cancel(edfs_image_t         *img,
+                     const edfs_inode_t   *dir_inode,
+                     const edfs_dir_pos_t *pos);
+
+/* Insert a new entry (name + inumber) into the directory inode, with
+ * edfs_dir_lookup_or_reserve() and edfs_dir_commit(). Returns 0 on
+ * success or negative errno, -EEXIST if the name is taken.        */
 int edfs_add_dir_entry(edfs_image_t       *img,
                        edfs_inode_t       *dir_inode,
                        const char         *name,
                        edfs_inumber_t      inumber);
 
+/* Find @name in directory @dir_inode through the directory's index,
+ * which is read from the directory blocks on first use. Returns 0
+ * and fills in *pos when found, -ENOENT when not, or a negative
+ * errno.                                                          */
+int edfs_dir_lookup(edfs_image_t       *img,
+                    const edfs_inode_t *dir_inode,
+                    const char         *name,
+                    edfs_dir_pos_t     *pos);
+
+/* Set *empty to whether @dir_inode has no entries. Returns 0 or a
+ * negative errno.                                                 */
+int edfs_dir_is_empty(edfs_image_t       *img,
+                      const edfs_inode_t *dir_inode,
+                      bool               *empty);
+
+/* Clear the entry at @pos, as found by edfs_dir_lookup(), in
+ * directory @dir_inode. Only that entry is written, through the
+ * block cache. Returns 0 or a negative errno.                     */
+int edfs_remove_dir_entry(edfs_image_t         *img,
+                          const edfs_inode_t   *dir_inode,
+                          const edfs_dir_pos_t *pos);
+
+/* Drop the index of directory @inumber; edfs_clear_inode() does so,
+ * since the inumber may be reused.                                */
+void edfs_invalidate_dir_index(edfs_image_t *img, edfs_inumber_t inumber);
+
 /* ------------------------------------------------------------- *
  *  Block-ensure helper (needed for write / truncate)            *
  * ------------------------------------------------------------- */
 
+/* Drop the cached block map of @inumber; must be called whenever
+ * its indirect blocks change.                                    */
+void edfs_invalidate_block_map(edfs_image_t *img, edfs_inumber_t inumber);
+
+/* Reserve the block map entry of @inumber while the file is open.
+ * Returns false if the entry is pinned for another inode; that inode
+ * keeps it, and @inumber's pointers are then read without caching.
+ * Each successful pin must be undone by edfs_unpin_block_map().  */
+bool edfs_pin_block_map(edfs_image_t *img, edfs_inumber_t inumber);
+void edfs_unpin_block_map(edfs_image_t *img, edfs_inumber_t inumber);
+
 /* Make sure data block #logical_idx exists for @inode.
  * Allocates data blocks (and indirect blocks) as needed and
  * writes the inode back to disk when it changes.
@@ -123,5 +572,41 @@ int edfs_ensure_block(edfs_image_t *img,
   uint32_t      logical_idx,
   edfs_block_t *block_out);
 
+/* Store in blocks[i] the disk block holding data block #first + i of
+ * @inode, for @count blocks, allocating blocks (and indirect blocks)
+ * that do not exist yet; fresh[i] tells whether blocks[i] is newly
+ * allocated and still has stale contents. Only the in-memory @inode is
+ * updated, also when an error is returned part-way; the caller writes
+ * it back. Returns 0 on success, negative errno on failure.       */
+int edfs_map_blocks(edfs_image_t *img,
+  edfs_inode_t *inode,          /* modified */
+  uint32_t      first,
+  uint32_t      count,
+  edfs_block_t *blocks,
+  bool         *fresh);
+
+/* Free data block #n_keep and everything after it, clear the block
+ * pointers and drop indirect blocks that became unused. Converts the
+ * inode back to direct pointers when they suffice, and writes it.
+ * Returns 0 on success, negative errno on failure.               */
+int edfs_truncate_blocks(edfs_image_t *img,
+  edfs_inode_t *inode,          /* modified */
+  uint32_t      n_keep);
+
+/* Free at most @max_blocks data blocks (0: all) of removed inode
+ * @inumber, from the end of the file, along with the indirect blocks
+ * that become unused, and clear the inode once nothing is left.
+ * Returns 1 while blocks remain, 0 when the inode was cleared, or a
+ * negative errno.                                                 */
+int edfs_reap_inode(edfs_image_t   *img,
+                    edfs_inumber_t  inumber,
+                    uint32_t        max_blocks);
+
+/* Free every inode marked EDFS_INODE_FLAG_ORPHAN, left behind by a
+ * previous mount that ended before releasing it. Call before the file
+ * system is used. Returns the number of inodes freed or a negative
+ * errno.                                                          */
+int edfs_recover_orphans(edfs_image_t *img);
+
  #endif /* __EDFS_COMMON_H__ */
  
\ No newline at end of file
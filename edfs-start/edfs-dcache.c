@@ -0,0 +1,310 @@
+/* EdFS -- An educational file system
+ *
+ * Copyright (C) 2019  Leiden University, The Netherlands.
+ */
+
+#include "edfs-dcache.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#define DCACHE_NONE (-1)
+
+/* Entries live in one preallocated array and are linked by index, both
+ * into a hash chain and into a doubly-linked LRU list (most recently
+ * used at the head). Unused entries are kept on a free list threaded
+ * through hash_next.
+ */
+typedef struct
+{
+  edfs_inumber_t parent;
+  edfs_inumber_t child;       /* 0: negative entry */
+  uint32_t       hash;
+  uint8_t        len;
+  char           name[EDFS_FILENAME_SIZE];
+
+  int32_t        hash_next;
+  int32_t        lru_prev;
+  int32_t        lru_next;
+} edfs_dentry_t;
+
+struct _edfs_dcache
+{
+  edfs_dentry_t *entries;
+  size_t         n_entries;
+
+  int32_t       *buckets;
+  uint32_t       bucket_mask;
+
+  int32_t        free_list;
+  int32_t        lru_head;
+  int32_t        lru_tail;
+
+  pthread_mutex_t lock;
+
+  edfs_dcache_stats_t stats;
+};
+
+
+/* FNV-1a over the component, seeded with the parent inumber. */
+static uint32_t
+dcache_hash(edfs_inumber_t parent, const char *name, size_t len)
+{
+  uint32_t h = 2166136261u ^ (parent * 2654435761u);
+
+  for (size_t i = 0; i < len; ++i)
+    {
+      h ^= (uint8_t)name[i];
+      h *= 16777619u;
+    }
+
+  return h;
+}
+
+static void
+lru_unlink(edfs_dcache_t *dc, int32_t idx)
+{
+  edfs_dentry_t *e = &dc->entries[idx];
+
+  if (e->lru_prev != DCACHE_NONE)
+    dc->entries[e->lru_prev].lru_next = e->lru_next;
+  else
+    dc->lru_head = e->lru_next;
+
+  if (e->lru_next != DCACHE_NONE)
+    dc->entries[e->lru_next].lru_prev = e->lru_prev;
+  else
+    dc->lru_tail = e->lru_prev;
+
+  e->lru_prev = e->lru_next = DCACHE_NONE;
+}
+
+static void
+lru_push_head(edfs_dcache_t *dc, int32_t idx)
+{
+  edfs_dentry_t *e = &dc->entries[idx];
+
+  e->lru_prev = DCACHE_NONE;
+  e->lru_next = dc->lru_head;
+  if (dc->lru_head != DCACHE_NONE)
+    dc->entries[dc->lru_head].lru_prev = idx;
+  dc->lru_head = idx;
+  if (dc->lru_tail == DCACHE_NONE)
+    dc->lru_tail = idx;
+}
+
+/* Remove entry @idx from its hash chain and the LRU list, and put it
+ * on the free list.
+ */
+static void
+dcache_release(edfs_dcache_t *dc, int32_t idx)
+{
+  edfs_dentry_t *e = &dc->entries[idx];
+  int32_t *link = &dc->buckets[e->hash & dc->bucket_mask];
+
+  while (*link != idx)
+    link = &dc->entries[*link].hash_next;
+  *link = e->hash_next;
+
+  lru_unlink(dc, idx);
+
+  e->hash_next = dc->free_list;
+  dc->free_list = idx;
+}
+
+static int32_t
+dcache_find(edfs_dcache_t *dc, uint32_t hash,
+            edfs_inumber_t parent, const char *name, size_t len)
+{
+  int32_t idx = dc->buckets[hash & dc->bucket_mask];
+
+  while (idx != DCACHE_NONE)
+    {
+      edfs_dentry_t *e = &dc->entries[idx];
+      if (e->hash == hash && e->parent == parent && e->len == len &&
+          memcmp(e->name, name, len) == 0)
+        return idx;
+
+      idx = e->hash_next;
+    }
+
+  return DCACHE_NONE;
+}
+
+
+edfs_dcache_t *
+edfs_dcache_new(size_t n_entries)
+{
+  if (n_entries == 0)
+    return NULL;
+
+  edfs_dcache_t *dc = calloc(1, sizeof(edfs_dcache_t));
+  if (!dc)
+    return NULL;
+
+  /* Keep the load factor at or below one entry per bucket. */
+  size_t n_buckets = 1;
+  while (n_buckets < n_entries)
+    n_buckets <<= 1;
+
+  dc->entries = calloc(n_entries, sizeof(edfs_dentry_t));
+  dc->buckets = malloc(n_buckets * sizeof(int32_t));
+  if (!dc->entries || !dc->buckets)
+    {
+      edfs_dcache_free(dc);
+      return NULL;
+    }
+
+  pthread_mutex_init(&dc->lock, NULL);
+  dc->n_entries = n_entries;
+  dc->bucket_mask = n_buckets - 1;
+  for (size_t i = 0; i < n_buckets; ++i)
+    dc->buckets[i] = DCACHE_NONE;
+
+  for (size_t i = 0; i < n_entries; ++i)
+    dc->entries[i].hash_next = (i + 1 < n_entries) ? (int32_t)(i + 1) : DCACHE_NONE;
+  dc->free_list = 0;
+  dc->lru_head = dc->lru_tail = DCACHE_NONE;
+
+  return dc;
+}
+
+void
+edfs_dcache_free(edfs_dcache_t *dc)
+{
+  if (!dc)
+    return;
+
+  free(dc->entries);
+  free(dc->buckets);
+  pthread_mutex_destroy(&dc->lock);
+  free(dc);
+}
+
+bool
+edfs_dcache_lookup(edfs_dcache_t  *dc,
+                   edfs_inumber_t  parent,
+                   const char     *name,
+                   size_t          len,
+                   edfs_inumber_t *child)
+{
+  if (!dc || len == 0 || len >= EDFS_FILENAME_SIZE)
+    return false;
+
+  pthread_mutex_lock(&dc->lock);
+
+  int32_t idx = dcache_find(dc, dcache_hash(parent, name, len),
+                            parent, name, len);
+  if (idx == DCACHE_NONE)
+    {
+      dc->stats.misses++;
+      pthread_mutex_unlock(&dc->lock);
+      return false;
+    }
+
+  lru_unlink(dc, idx);
+  lru_push_head(dc, idx);
+
+  *child = dc->entries[idx].child;
+  if (*child == 0)
+    dc->stats.negative_hits++;
+  else
+    dc->stats.hits++;
+
+  pthread_mutex_unlock(&dc->lock);
+  return true;
+}
+
+void
+edfs_dcache_insert(edfs_dcache_t  *dc,
+                   edfs_inumber_t  parent,
+                   const char     *name,
+                   size_t          len,
+                   edfs_inumber_t  child)
+{
+  if (!dc || len == 0 || len >= EDFS_FILENAME_SIZE)
+    return;
+
+  uint32_t hash = dcache_hash(parent, name, len);
+
+  pthread_mutex_lock(&dc->lock);
+
+  int32_t idx = dcache_find(dc, hash, parent, name, len);
+  if (idx != DCACHE_NONE)
+    {
+      dc->entries[idx].child = child;
+      lru_unlink(dc, idx);
+      lru_push_head(dc, idx);
+      pthread_mutex_unlock(&dc->lock);
+      return;
+    }
+
+  if (dc->free_list == DCACHE_NONE)
+    {
+      dcache_release(dc, dc->lru_tail);
+      dc->stats.evictions++;
+    }
+
+  idx = dc->free_list;
+  edfs_dentry_t *e = &dc->entries[idx];
+  dc->free_list = e->hash_next;
+
+  e->parent = parent;
+  e->child = child;
+  e->hash = hash;
+  e->len = len;
+  memcpy(e->name, name, len);
+  e->name[len] = 0;
+
+  int32_t *bucket = &dc->buckets[hash & dc->bucket_mask];
+  e->hash_next = *bucket;
+  *bucket = idx;
+
+  lru_push_head(dc, idx);
+  pthread_mutex_unlock(&dc->lock);
+}
+
+void
+edfs_dcache_purge_parent(edfs_dcache_t *dc, edfs_inumber_t parent)
+{
+  if (!dc)
+    return;
+
+  pthread_mutex_lock(&dc->lock);
+  int32_t idx = dc->lru_head;
+  while (idx != DCACHE_NONE)
+    {
+      int32_t next = dc->entries[idx].lru_next;
+      if (dc->entries[idx].parent == parent)
+        dcache_release(dc, idx);
+      idx = next;
+    }
+  pthread_mutex_unlock(&dc->lock);
+}
+
+void
+edfs_dcache_get_stats(edfs_dcache_t *dc, edfs_dcache_stats_t *stats)
+{
+  if (!dc)
+    {
+      memset(stats, 0, sizeof(edfs_dcache_stats_t));
+      return;
+    }
+
+  pthread_mutex_lock(&dc->lock);
+  *stats = dc->stats;
+  pthread_mutex_unlock(&dc->lock);
+}
+
+void
+edfs_dcache_print_stats(edfs_dcache_t *dc, FILE *out)
+{
+  edfs_dcache_stats_t s;
+  edfs_dcache_get_stats(dc, &s);
+
+  fprintf(out, "dcache: %llu hits, %llu negative hits, %llu misses, "
+          "%llu evictions\n",
+          (unsigned long long)s.hits, (unsigned long long)s.negative_hits,
+          (unsigned long long)s.misses, (unsigned long long)s.evictions);
+}
@@ -0,0 +1,73 @@
+/* EdFS -- An educational file system
+ *
+ * Copyright (C) 2019  Leiden University, The Netherlands.
+ */
+
+#ifndef __EDFS_DCACHE_H__
+#define __EDFS_DCACHE_H__
+
+#include "edfs.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+
+/*
+ * Directory entry cache
+ *
+ * Maps (parent inumber, path component) to the inumber of the child.
+ * A child inumber of 0 is a negative entry: the name is known not to
+ * exist in the parent. The cache holds a fixed number of entries and
+ * evicts the least recently used entry when full. All functions may
+ * be called from several threads.
+ */
+
+/* Default number of entries kept in the cache. */
+#define EDFS_DCACHE_N_ENTRIES 1024
+
+typedef struct
+{
+  uint64_t hits;
+  uint64_t negative_hits;
+  uint64_t misses;
+  uint64_t evictions;
+} edfs_dcache_stats_t;
+
+typedef struct _edfs_dcache edfs_dcache_t;
+
+
+edfs_dcache_t *edfs_dcache_new            (size_t          n_entries);
+void           edfs_dcache_free           (edfs_dcache_t  *dcache);
+
+/* Look up @name (of @len bytes, not necessarily null-terminated) in
+ * directory @parent. Returns true on a cache hit, in which case *child
+ * is set to the child inumber, or to 0 for a negative entry.
+ */
+bool           edfs_dcache_lookup         (edfs_dcache_t  *dcache,
+                                           edfs_inumber_t  parent,
+                                           const char     *name,
+                                           size_t          len,
+                                           edfs_inumber_t *child);
+
+/* Insert or update the entry for @name in @parent. Pass 0 as @child
+ * to record a negative entry.
+ */
+void           edfs_dcache_insert         (edfs_dcache_t  *dcache,
+                                           edfs_inumber_t  parent,
+                                           const char     *name,
+                                           size_t          len,
+                                           edfs_inumber_t  child);
+
+/* Drop every entry that has @parent as its parent directory. Must be
+ * called when a directory is removed, since its inumber may be reused.
+ */
+void           edfs_dcache_purge_parent   (edfs_dcache_t  *dcache,
+                                           edfs_inumber_t  parent);
+
+void           edfs_dcache_get_stats      (edfs_dcache_t       *dcache,
+                                           edfs_dcache_stats_t *stats);
+void           edfs_dcache_print_stats    (edfs_dcache_t  *dcache,
+                                           FILE           *out);
+
+#endif /* __EDFS_DCACHE_H__ */
@@ -0,0 +1,699 @@
+/* EdFS -- An educational file system
+ *
+ * Copyright (C) 2019  Leiden University, The Netherlands.
+ */
+
+/* for preadv(), pwritev() and syscall() */
+#define _DEFAULT_SOURCE
+
+#include "edfs-io.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#if defined(__linux__) && defined(__has_include)
+# if __has_include(<linux/io_uring.h>)
+#  define EDFS_HAVE_URING 1
+#  include <linux/io_uring.h>
+#  include <sys/syscall.h>
+# endif
+#endif
+
+
+/* A backend. submit() starts the requests, complete() waits for them
+ * and stores in each request's res the number of bytes transferred or
+ * a negative errno. A backend with a shared submission state sets
+ * serialize, and then runs one batch at a time.
+ */
+typedef struct
+{
+  int  (*submit)   (edfs_io_t *io, edfs_io_req_t *reqs, int n);
+  int  (*complete) (edfs_io_t *io, edfs_io_req_t *reqs, int n);
+  void (*free)     (edfs_io_t *io);
+  bool serialize;
+} edfs_io_ops_t;
+
+typedef struct _edfs_uring edfs_uring_t;
+
+struct _edfs_io
+{
+  int                  fd;
+  edfs_io_backend_t    backend;
+  const edfs_io_ops_t *ops;
+  int                  max_batch;   /* requests per submit() */
+  pthread_mutex_t      lock;        /* for serialize */
+
+  /* Area given to edfs_io_register_buffer(). */
+  uint8_t             *buf;
+  size_t               buf_len;
+
+  /* mmap backend */
+  uint8_t             *map;
+  size_t               map_size;
+  size_t               page_size;
+
+  /* uring backend */
+  edfs_uring_t        *uring;
+};
+
+
+static size_t
+io_req_len(const edfs_io_req_t *req)
+{
+  size_t len = 0;
+  for (int i = 0; i < req->iovcnt; ++i)
+    len += req->iov[i].iov_len;
+  return len;
+}
+
+/* Transfer what is left of @req after its first @done bytes with
+ * pread or pwrite. Returns the number of bytes transferred in total or
+ * -EIO.
+ */
+static ssize_t
+io_rw_fd(edfs_io_t *io, edfs_io_req_t *req, size_t done)
+{
+  size_t total = done;
+
+  for (int i = 0; i < req->iovcnt; ++i)
+    {
+      uint8_t *base = req->iov[i].iov_base;
+      size_t   len = req->iov[i].iov_len;
+
+      if (done >= len)
+        {
+          done -= len;
+          continue;
+        }
+
+      base += done;
+      len -= done;
+      done = 0;
+
+      while (len > 0)
+        {
+          off_t pos = req->pos + total;
+          ssize_t n = req->write ? pwrite(io->fd, base, len, pos)
+                                 : pread(io->fd, base, len, pos);
+          if (n <= 0)
+            return -EIO;
+
+          base += n;
+          len -= n;
+          total += n;
+        }
+    }
+
+  return total;
+}
+
+
+/*
+ * pread backend
+ */
+
+static int
+pread_submit(edfs_io_t *io, edfs_io_req_t *reqs, int n)
+{
+  for (int i = 0; i < n; ++i)
+    {
+      edfs_io_req_t *req = &reqs[i];
+      ssize_t done = 0;
+
+      /* Scattered buffers in one system call. */
+      if (req->iovcnt > 1)
+        {
+          done = req->write ? pwritev(io->fd, req->iov, req->iovcnt, req->pos)
+                            : preadv(io->fd, req->iov, req->iovcnt, req->pos);
+          if (done < 0)
+            done = 0;
+        }
+
+      req->res = io_rw_fd(io, req, done);
+    }
+
+  return 0;
+}
+
+static int
+io_complete_nop(edfs_io_t *io, edfs_io_req_t *reqs, int n)
+{
+  return 0;
+}
+
+static void
+io_free_nop(edfs_io_t *io)
+{
+}
+
+static const edfs_io_ops_t pread_ops =
+{
+  .submit   = pread_submit,
+  .complete = io_complete_nop,
+  .free     = io_free_nop,
+};
+
+
+/*
+ * mmap backend
+ */
+
+/* Whether [@pos, @pos + @len) lies within the mapping. */
+static inline bool
+io_in_map(edfs_io_t *io, off_t pos, size_t len)
+{
+  return pos >= 0 && (size_t)pos <= io->map_size &&
+         len <= io->map_size - pos;
+}
+
+static int
+mmap_submit(edfs_io_t *io, edfs_io_req_t *reqs, int n)
+{
+  for (int i = 0; i < n; ++i)
+    {
+      edfs_io_req_t *req = &reqs[i];
+      size_t len = io_req_len(req);
+
+      if (!io_in_map(io, req->pos, len))
+        {
+          req->res = -EIO;
+          continue;
+        }
+
+      uint8_t *p = io->map + req->pos;
+      for (int j = 0; j < req->iovcnt; ++j)
+        {
+          if (req->write)
+            memcpy(p, req->iov[j].iov_base, req->iov[j].iov_len);
+          else
+            memcpy(req->iov[j].iov_base, p, req->iov[j].iov_len);
+          p += req->iov[j].iov_len;
+        }
+      req->res = len;
+    }
+
+  return 0;
+}
+
+static void
+mmap_free(edfs_io_t *io)
+{
+  munmap(io->map, io->map_size);
+  io->map = NULL;
+}
+
+static const edfs_io_ops_t mmap_ops =
+{
+  .submit   = mmap_submit,
+  .complete = io_complete_nop,
+  .free     = mmap_free,
+};
+
+
+/*
+ * io_uring backend
+ */
+
+#ifdef EDFS_HAVE_URING
+
+/* Submission queue entries; also the largest batch per system call. */
+#define URING_ENTRIES 64
+
+struct _edfs_uring
+{
+  int       ring_fd;
+  bool      fixed_file;     /* the image fd is registered as file 0 */
+  bool      fixed_buf;      /* io->buf is registered as buffer 0 */
+
+  void     *sq_ring;
+  size_t    sq_ring_size;
+  void     *cq_ring;
+  size_t    cq_ring_size;
+  struct io_uring_sqe *sqes;
+  size_t    sqes_size;
+
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_cqe *cqes;
+
+  unsigned  n_inflight;     /* submitted, completion not reaped yet */
+};
+
+static int
+uring_enter(int ring_fd, unsigned to_submit, unsigned min_complete,
+            unsigned flags)
+{
+  return syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete,
+                 flags, NULL, 0);
+}
+
+static void
+uring_register_buffer(edfs_io_t *io)
+{
+  edfs_uring_t *r = io->uring;
+  struct iovec iov = { .iov_base = io->buf, .iov_len = io->buf_len };
+
+  /* May fail on a low RLIMIT_MEMLOCK; then plain reads are used. */
+  r->fixed_buf = syscall(__NR_io_uring_register, r->ring_fd,
+                         IORING_REGISTER_BUFFERS, &iov, 1) == 0;
+}
+
+/* Whether @iov lies within the registered buffer. */
+static bool
+uring_is_fixed(edfs_io_t *io, const struct iovec *iov)
+{
+  uint8_t *base = iov->iov_base;
+
+  return io->uring->fixed_buf && base >= io->buf &&
+         iov->iov_len <= io->buf_len - (size_t)(base - io->buf);
+}
+
+static int
+uring_submit(edfs_io_t *io, edfs_io_req_t *reqs, int n)
+{
+  edfs_uring_t *r = io->uring;
+  unsigned tail = *r->sq_tail;
+
+  for (int i = 0; i < n; ++i)
+    {
+      edfs_io_req_t *req = &reqs[i];
+      unsigned idx = tail & *r->sq_mask;
+      struct io_uring_sqe *sqe = &r->sqes[idx];
+
+      memset(sqe, 0, sizeof(struct io_uring_sqe));
+      sqe->fd = r->fixed_file ? 0 : io->fd;
+      sqe->flags = r->fixed_file ? IOSQE_FIXED_FILE : 0;
+      sqe->off = req->pos;
+      sqe->user_data = (uintptr_t)req;
+
+      if (req->iovcnt == 1 && uring_is_fixed(io, &req->iov[0]))
+        {
+          sqe->opcode = req->write ? IORING_OP_WRITE_FIXED
+                                   : IORING_OP_READ_FIXED;
+          sqe->addr = (uintptr_t)req->iov[0].iov_base;
+          sqe->len = req->iov[0].iov_len;
+          sqe->buf_index = 0;
+        }
+      else
+        {
+          sqe->opcode = req->write ? IORING_OP_WRITEV : IORING_OP_READV;
+          sqe->addr = (uintptr_t)req->iov;
+          sqe->len = req->iovcnt;
+        }
+
+      r->sq_array[idx] = idx;
+      tail++;
+    }
+
+  __atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+
+  /* The kernel takes the entries in order. When it refuses the rest,
+   * they are taken out of the ring again, so that a later submission
+   * does not start them; only io_uring_enter() consumes entries, and
+   * it is not running. Those requests fail here and are retried by
+   * edfs_io_run().
+   */
+  int submitted = 0;
+  while (submitted < n)
+    {
+      int ret = uring_enter(r->ring_fd, n - submitted, 0, 0);
+      if (ret < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+        {
+          __atomic_store_n(r->sq_tail,
+                           __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE),
+                           __ATOMIC_RELEASE);
+          for (int i = submitted; i < n; ++i)
+            reqs[i].res = -EIO;
+          break;
+        }
+      if (ret > 0)
+        submitted += ret;
+    }
+
+  r->n_inflight = submitted;
+  return 0;
+}
+
+/* Reap the completion of every request submitted. Until then the
+ * kernel may still use their buffers, so there is no giving up on
+ * them: a failed wait is simply repeated.
+ */
+static int
+uring_complete(edfs_io_t *io, edfs_io_req_t *reqs, int n)
+{
+  edfs_uring_t *r = io->uring;
+  unsigned head = *r->cq_head;
+
+  while (r->n_inflight > 0)
+    {
+      unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+      if (head == tail)
+        {
+          uring_enter(r->ring_fd, 0, 1, IORING_ENTER_GETEVENTS);
+          continue;
+        }
+
+      struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+      edfs_io_req_t *req = (edfs_io_req_t *)(uintptr_t)cqe->user_data;
+
+      req->res = cqe->res;
+      head++;
+      r->n_inflight--;
+      __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+    }
+
+  return 0;
+}
+
+static void
+uring_destroy(edfs_uring_t *r)
+{
+  if (r->sqes)
+    munmap(r->sqes, r->sqes_size);
+  if (r->cq_ring && r->cq_ring != r->sq_ring)
+    munmap(r->cq_ring, r->cq_ring_size);
+  if (r->sq_ring)
+    munmap(r->sq_ring, r->sq_ring_size);
+  if (r->ring_fd >= 0)
+    close(r->ring_fd);
+  free(r);
+}
+
+static void
+uring_free(edfs_io_t *io)
+{
+  uring_destroy(io->uring);
+  io->uring = NULL;
+}
+
+static const edfs_io_ops_t uring_ops =
+{
+  .submit    = uring_submit,
+  .complete  = uring_complete,
+  .free      = uring_free,
+  .serialize = true,
+};
+
+int
+edfs_io_use_uring(edfs_io_t *io)
+{
+  edfs_uring_t *r = calloc(1, sizeof(edfs_uring_t));
+  if (!r)
+    return -ENOMEM;
+
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+
+  r->ring_fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+  if (r->ring_fd < 0)
+    {
+      int rc = errno == EPERM ? -ENOSYS : -errno;
+      free(r);
+      return rc;
+    }
+
+  /* Map the rings; newer kernels share one mapping for both. */
+  r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  r->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+      if (r->cq_ring_size > r->sq_ring_size)
+        r->sq_ring_size = r->cq_ring_size;
+      r->cq_ring_size = r->sq_ring_size;
+    }
+
+  r->sq_ring = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED, r->ring_fd, IORING_OFF_SQ_RING);
+  if (r->sq_ring == MAP_FAILED)
+    r->sq_ring = NULL;
+
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    r->cq_ring = r->sq_ring;
+  else
+    {
+      r->cq_ring = mmap(NULL, r->cq_ring_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED, r->ring_fd, IORING_OFF_CQ_RING);
+      if (r->cq_ring == MAP_FAILED)
+        r->cq_ring = NULL;
+    }
+
+  r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED, r->ring_fd, IORING_OFF_SQES);
+  if (r->sqes == MAP_FAILED)
+    r->sqes = NULL;
+
+  if (!r->sq_ring || !r->cq_ring || !r->sqes)
+    {
+      uring_destroy(r);
+      return -ENOMEM;
+    }
+
+  uint8_t *sq = r->sq_ring, *cq = r->cq_ring;
+  r->sq_head  = (unsigned *)(sq + p.sq_off.head);
+  r->sq_tail  = (unsigned *)(sq + p.sq_off.tail);
+  r->sq_mask  = (unsigned *)(sq + p.sq_off.ring_mask);
+  r->sq_array = (unsigned *)(sq + p.sq_off.array);
+  r->cq_head  = (unsigned *)(cq + p.cq_off.head);
+  r->cq_tail  = (unsigned *)(cq + p.cq_off.tail);
+  r->cq_mask  = (unsigned *)(cq + p.cq_off.ring_mask);
+  r->cqes     = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+  r->fixed_file = syscall(__NR_io_uring_register, r->ring_fd,
+                          IORING_REGISTER_FILES, &io->fd, 1) == 0;
+
+  io->ops->free(io);
+  io->uring = r;
+  if (io->buf)
+    uring_register_buffer(io);
+
+  io->ops = &uring_ops;
+  io->backend = EDFS_IO_URING;
+  io->max_batch = p.sq_entries;
+  return 0;
+}
+
+#else /* !EDFS_HAVE_URING */
+
+int
+edfs_io_use_uring(edfs_io_t *io)
+{
+  return -ENOSYS;
+}
+
+#endif /* EDFS_HAVE_URING */
+
+
+/*
+ * Common entry points
+ */
+
+edfs_io_t *
+edfs_io_new(int fd)
+{
+  edfs_io_t *io = calloc(1, sizeof(edfs_io_t));
+  if (!io)
+    return NULL;
+
+  io->fd = fd;
+  io->backend = EDFS_IO_PREAD;
+  io->ops = &pread_ops;
+  io->max_batch = INT_MAX;
+  io->page_size = sysconf(_SC_PAGESIZE);
+  pthread_mutex_init(&io->lock, NULL);
+  return io;
+}
+
+void
+edfs_io_free(edfs_io_t *io)
+{
+  if (!io)
+    return;
+
+  io->ops->free(io);
+  pthread_mutex_destroy(&io->lock);
+  free(io);
+}
+
+int
+edfs_io_map(edfs_io_t *io, size_t size)
+{
+  void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   io->fd, 0);
+  if (map == MAP_FAILED)
+    return -errno;
+
+  io->ops->free(io);
+  io->map = map;
+  io->map_size = size;
+  io->ops = &mmap_ops;
+  io->backend = EDFS_IO_MMAP;
+  io->max_batch = INT_MAX;
+  return 0;
+}
+
+edfs_io_backend_t
+edfs_io_get_backend(edfs_io_t *io)
+{
+  return io->backend;
+}
+
+void
+edfs_io_register_buffer(edfs_io_t *io, void *mem, size_t len)
+{
+  io->buf = mem;
+  io->buf_len = len;
+
+#ifdef EDFS_HAVE_URING
+  if (io->uring)
+    uring_register_buffer(io);
+#endif
+}
+
+void *
+edfs_io_get_pointer(edfs_io_t *io, off_t pos, size_t len)
+{
+  if (io->backend != EDFS_IO_MMAP || !io_in_map(io, pos, len))
+    return NULL;
+
+  return io->map + pos;
+}
+
+int
+edfs_io_run(edfs_io_t *io, edfs_io_req_t *reqs, int n)
+{
+  for (int i = 0; i < n; i += io->max_batch)
+    {
+      int m = n - i < io->max_batch ? n - i : io->max_batch;
+
+      if (io->ops->serialize)
+        pthread_mutex_lock(&io->lock);
+      int rc = io->ops->submit(io, reqs + i, m);
+      if (rc == 0)
+        rc = io->ops->complete(io, reqs + i, m);
+      if (io->ops->serialize)
+        pthread_mutex_unlock(&io->lock);
+
+      if (rc < 0)
+        for (int j = i; j < i + m; ++j)
+          reqs[j].res = rc;
+    }
+
+  /* Short transfers are finished, and requests the backend failed on
+   * are retried, with plain system calls.
+   */
+  int res = 0;
+  for (int i = 0; i < n; ++i)
+    {
+      edfs_io_req_t *req = &reqs[i];
+      ssize_t len = io_req_len(req);
+
+      if (req->res != len)
+        req->res = io_rw_fd(io, req, req->res > 0 ? req->res : 0);
+
+      if (req->res == len)
+        req->res = 0;
+      else
+        res = req->res = -EIO;
+    }
+
+  return res;
+}
+
+/* Fill in @req for a transfer from or to a single buffer. */
+static void
+io_req_init(edfs_io_req_t *req, bool write, void *buf, size_t len,
+            off_t pos)
+{
+  req->write = write;
+  req->pos = pos;
+  req->vec.iov_base = buf;
+  req->vec.iov_len = len;
+  req->iov = &req->vec;
+  req->iovcnt = 1;
+  req->res = 0;
+}
+
+int
+edfs_io_read(edfs_io_t *io, void *dst, size_t len, off_t pos)
+{
+  edfs_io_req_t req;
+
+  io_req_init(&req, false, dst, len, pos);
+  return edfs_io_run(io, &req, 1);
+}
+
+int
+edfs_io_write(edfs_io_t *io, const void *src, size_t len, off_t pos)
+{
+  edfs_io_req_t req;
+
+  io_req_init(&req, true, (void *)src, len, pos);
+  return edfs_io_run(io, &req, 1);
+}
+
+void
+edfs_io_batch_init(edfs_io_batch_t *batch)
+{
+  batch->n = 0;
+}
+
+int
+edfs_io_batch_add(edfs_io_t *io, edfs_io_batch_t *batch, bool write,
+                  void *buf, size_t len, off_t pos)
+{
+  int rc = 0;
+
+  if (batch->n == EDFS_IO_BATCH_SIZE)
+    rc = edfs_io_batch_run(io, batch);
+
+  io_req_init(&batch->reqs[batch->n++], write, buf, len, pos);
+  return rc;
+}
+
+int
+edfs_io_batch_run(edfs_io_t *io, edfs_io_batch_t *batch)
+{
+  int rc = edfs_io_run(io, batch->reqs, batch->n);
+
+  batch->n = 0;
+  return rc;
+}
+
+int
+edfs_io_writeback(edfs_io_t *io, off_t pos, size_t len)
+{
+  if (io->backend != EDFS_IO_MMAP || len == 0)
+    return 0;
+  if (!io_in_map(io, pos, len))
+    return -EIO;
+
+  /* msync wants a page-aligned start. */
+  size_t start = pos - pos % io->page_size;
+  if (msync(io->map + start, pos + len - start, MS_ASYNC) < 0)
+    return -EIO;
+
+  return 0;
+}
+
+int
+edfs_io_sync(edfs_io_t *io, bool datasync)
+{
+  if (io->backend == EDFS_IO_MMAP && msync(io->map, io->map_size, MS_SYNC) < 0)
+    return -errno;
+
+  if ((datasync ? fdatasync(io->fd) : fsync(io->fd)) < 0)
+    return -errno;
+
+  return 0;
+}
@@ -0,0 +1,142 @@
+/* EdFS -- An educational file system
+ *
+ * Copyright (C) 2019  Leiden University, The Netherlands.
+ */
+
+#ifndef __EDFS_IO_H__
+#define __EDFS_IO_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+
+/*
+ * Image I/O
+ *
+ * All reads and writes of the image file go through an edfs_io_t,
+ * as requests that are submitted in batches and then completed. Each
+ * backend implements the submit and complete steps (edfs_io_ops_t):
+ *
+ * - pread: one system call per request, done while submitting
+ * - mmap: the file system is mapped into memory once and requests
+ *   are served with memcpy; edfs_io_sync() then also writes the
+ *   mapping back with msync(). Until then, the kernel may write
+ *   modified pages back in any order.
+ * - uring: a batch becomes one io_uring_enter() call. The image fd is
+ *   registered with the ring, and so is the memory of the block cache
+ *   (edfs_io_register_buffer()), which is then read and written with
+ *   the fixed-buffer operations.
+ *
+ * A backend that cannot be set up leaves the pread backend in place.
+ */
+
+typedef enum
+{
+  EDFS_IO_PREAD = 0,
+  EDFS_IO_MMAP,
+  EDFS_IO_URING,
+} edfs_io_backend_t;
+
+typedef struct _edfs_io edfs_io_t;
+
+/* One read or write of the image. */
+typedef struct
+{
+  bool          write;
+  off_t         pos;
+  struct iovec *iov;
+  int           iovcnt;
+  struct iovec  vec;        /* iov for a single buffer */
+  int           res;        /* on completion: 0 or a negative errno */
+} edfs_io_req_t;
+
+/* Requests gathered by an edfs_io_batch_t before they are run. */
+#define EDFS_IO_BATCH_SIZE 32
+
+typedef struct
+{
+  edfs_io_req_t reqs[EDFS_IO_BATCH_SIZE];
+  int           n;
+} edfs_io_batch_t;
+
+
+edfs_io_t     *edfs_io_new                (int             fd);
+void           edfs_io_free               (edfs_io_t      *io);
+
+/* Switch to the mmap backend for the first @size bytes of the image.
+ * Returns 0 on success or a negative errno, in which case the current
+ * backend stays in use.
+ */
+int            edfs_io_map                (edfs_io_t      *io,
+                                           size_t          size);
+
+/* Switch to the io_uring backend. Returns 0 on success or a negative
+ * errno (-ENOSYS if the kernel or the build lacks io_uring), in which
+ * case the current backend stays in use.
+ */
+int            edfs_io_use_uring          (edfs_io_t      *io);
+
+edfs_io_backend_t edfs_io_get_backend     (edfs_io_t      *io);
+
+/* Announce that requests will often use the @len bytes at @mem, so
+ * that the backend can register them. At most one area is kept.
+ */
+void           edfs_io_register_buffer    (edfs_io_t      *io,
+                                           void           *mem,
+                                           size_t          len);
+
+/* Address of image offset @pos with the mmap backend, NULL otherwise.
+ * The first @len bytes at it are valid.
+ */
+void          *edfs_io_get_pointer        (edfs_io_t      *io,
+                                           off_t           pos,
+                                           size_t          len);
+
+/* Submit the @n requests in @reqs and wait until all are done. Short
+ * transfers are completed. Returns 0 when every request succeeded, or
+ * the error of a failed one; each request has its own outcome in res.
+ */
+int            edfs_io_run                (edfs_io_t      *io,
+                                           edfs_io_req_t  *reqs,
+                                           int             n);
+
+/* Transfer exactly @len bytes at image offset @pos, as a batch of one.
+ * Return 0 on success or -EIO.
+ */
+int            edfs_io_read               (edfs_io_t      *io,
+                                           void           *dst,
+                                           size_t          len,
+                                           off_t           pos);
+int            edfs_io_write              (edfs_io_t      *io,
+                                           const void     *src,
+                                           size_t          len,
+                                           off_t           pos);
+
+/* Gather single-buffer requests and run them together. Adding to a
+ * full batch runs it first. Both return 0 or the error of a failed
+ * request.
+ */
+void           edfs_io_batch_init         (edfs_io_batch_t *batch);
+int            edfs_io_batch_add          (edfs_io_t       *io,
+                                           edfs_io_batch_t *batch,
+                                           bool             write,
+                                           void            *buf,
+                                           size_t           len,
+                                           off_t            pos);
+int            edfs_io_batch_run          (edfs_io_t       *io,
+                                           edfs_io_batch_t *batch);
+
+/* Make [@pos, @pos + @len) durable; only the mmap backend has work to
+ * do here, for the others the data is in the page cache already.
+ */
+int            edfs_io_writeback          (edfs_io_t      *io,
+                                           off_t           pos,
+                                           size_t          len);
+
+/* Write everything back and sync the image file to disk. */
+int            edfs_io_sync               (edfs_io_t      *io,
+                                           bool            datasync);
+
+#endif /* __EDFS_IO_H__ */
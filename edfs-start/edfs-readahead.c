@@ -0,0 +1,220 @@
+/* EdFS -- An educational file system
+ *
+ * Copyright (C) 2019  Leiden University, The Netherlands.
+ */
+
+#include "edfs-readahead.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+
+/*
+ * Window tracking
+ */
+
+void
+edfs_ra_init(edfs_ra_t *ra)
+{
+  memset(ra, 0, sizeof(edfs_ra_t));
+  pthread_mutex_init(&ra->lock, NULL);
+}
+
+void
+edfs_ra_destroy(edfs_ra_t *ra)
+{
+  pthread_mutex_destroy(&ra->lock);
+}
+
+bool
+edfs_ra_update(edfs_ra_t *ra, off_t offset, size_t size,
+               uint32_t file_size, uint16_t block_size, uint32_t max_window,
+               uint32_t *first, uint32_t *count)
+{
+  const uint32_t n_blocks = (file_size + block_size - 1) / block_size;
+  const uint32_t read_end = (offset + size + block_size - 1) / block_size;
+  bool due = false;
+
+  pthread_mutex_lock(&ra->lock);
+
+  if (offset == ra->next_offset)
+    ra->seq_reads++;
+  else
+    {
+      /* Random access: start over. */
+      ra->seq_reads = 0;
+      ra->window = 0;
+    }
+  ra->next_offset = offset + size;
+
+  if (max_window > 0 && ra->seq_reads >= EDFS_RA_SEQ_READS)
+    {
+      /* The reader may have overtaken the previous window. */
+      if (ra->window == 0 || ra->end < read_end)
+        ra->end = read_end;
+
+      if (ra->end < n_blocks && ra->end - read_end <= ra->window / 2)
+        {
+          uint32_t window = ra->window ? 2 * ra->window : EDFS_RA_MIN_BLOCKS;
+          if (window > max_window)
+            window = max_window;
+
+          *first = ra->end;
+          *count = n_blocks - ra->end < window ? n_blocks - ra->end : window;
+          ra->end += *count;
+          ra->window = window;
+          due = true;
+        }
+    }
+
+  pthread_mutex_unlock(&ra->lock);
+  return due;
+}
+
+
+/*
+ * Helper thread
+ */
+
+typedef struct
+{
+  edfs_inumber_t inumber;
+  uint32_t       first;
+  uint32_t       count;
+} edfs_ra_request_t;
+
+struct _edfs_ra_queue
+{
+  edfs_ra_fn       fn;
+  void            *userdata;
+
+  /* Ring buffer of pending requests. */
+  edfs_ra_request_t requests[EDFS_RA_QUEUE_SIZE];
+  size_t           head;
+  size_t           n_pending;
+  bool             stop;
+
+  pthread_t        thread;
+  pthread_mutex_t  lock;
+  pthread_cond_t   cond;
+
+  edfs_ra_stats_t  stats;
+};
+
+static void *
+edfs_ra_thread(void *data)
+{
+  edfs_ra_queue_t *q = data;
+
+  pthread_mutex_lock(&q->lock);
+  while (!q->stop)
+    {
+      if (q->n_pending == 0)
+        {
+          pthread_cond_wait(&q->cond, &q->lock);
+          continue;
+        }
+
+      edfs_ra_request_t r = q->requests[q->head];
+      q->head = (q->head + 1) % EDFS_RA_QUEUE_SIZE;
+      q->n_pending--;
+
+      pthread_mutex_unlock(&q->lock);
+      q->fn(q->userdata, r.inumber, r.first, r.count);
+      pthread_mutex_lock(&q->lock);
+    }
+  pthread_mutex_unlock(&q->lock);
+
+  return NULL;
+}
+
+edfs_ra_queue_t *
+edfs_ra_queue_new(edfs_ra_fn fn, void *userdata)
+{
+  edfs_ra_queue_t *q = calloc(1, sizeof(edfs_ra_queue_t));
+  if (!q)
+    return NULL;
+
+  q->fn = fn;
+  q->userdata = userdata;
+  pthread_mutex_init(&q->lock, NULL);
+  pthread_cond_init(&q->cond, NULL);
+
+  if (pthread_create(&q->thread, NULL, edfs_ra_thread, q) != 0)
+    {
+      pthread_cond_destroy(&q->cond);
+      pthread_mutex_destroy(&q->lock);
+      free(q);
+      return NULL;
+    }
+
+  return q;
+}
+
+void
+edfs_ra_queue_free(edfs_ra_queue_t *q)
+{
+  if (!q)
+    return;
+
+  pthread_mutex_lock(&q->lock);
+  q->stop = true;
+  pthread_cond_signal(&q->cond);
+  pthread_mutex_unlock(&q->lock);
+
+  pthread_join(q->thread, NULL);
+
+  pthread_cond_destroy(&q->cond);
+  pthread_mutex_destroy(&q->lock);
+  free(q);
+}
+
+bool
+edfs_ra_queue_submit(edfs_ra_queue_t *q, edfs_inumber_t inumber,
+                     uint32_t first, uint32_t count)
+{
+  bool queued = false;
+
+  pthread_mutex_lock(&q->lock);
+  q->stats.windows++;
+  if (q->n_pending < EDFS_RA_QUEUE_SIZE)
+    {
+      size_t tail = (q->head + q->n_pending) % EDFS_RA_QUEUE_SIZE;
+
+      q->requests[tail].inumber = inumber;
+      q->requests[tail].first = first;
+      q->requests[tail].count = count;
+      q->n_pending++;
+      pthread_cond_signal(&q->cond);
+      queued = true;
+    }
+  else
+    q->stats.dropped++;
+  pthread_mutex_unlock(&q->lock);
+
+  return queued;
+}
+
+void
+edfs_ra_queue_get_stats(edfs_ra_queue_t *q, edfs_ra_stats_t *stats)
+{
+  if (!q)
+    {
+      memset(stats, 0, sizeof(edfs_ra_stats_t));
+      return;
+    }
+
+  pthread_mutex_lock(&q->lock);
+  *stats = q->stats;
+  pthread_mutex_unlock(&q->lock);
+}
+
+void
+edfs_ra_queue_print_stats(edfs_ra_queue_t *q, FILE *out)
+{
+  edfs_ra_stats_t s;
+  edfs_ra_queue_get_stats(q, &s);
+
+  fprintf(out, "readahead: %llu windows, %llu dropped\n",
+          (unsigned long long)s.windows, (unsigned long long)s.dropped);
+}
@@ -0,0 +1,105 @@
+/* EdFS -- An educational file system
+ *
+ * Copyright (C) 2019  Leiden University, The Netherlands.
+ */
+
+#ifndef __EDFS_READAHEAD_H__
+#define __EDFS_READAHEAD_H__
+
+#include "edfs.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <pthread.h>
+
+
+/*
+ * Sequential read-ahead
+ *
+ * Every open file has an edfs_ra_t that follows the offsets of its
+ * reads. After EDFS_RA_SEQ_READS reads in a row that each continue
+ * where the previous one ended, a window of EDFS_RA_MIN_BLOCKS blocks
+ * past the read is loaded into the block cache. Every time the reader
+ * gets within half a window of the end of what was read ahead, the
+ * next window is issued and the window doubles, up to a maximum. A
+ * read anywhere else collapses the window.
+ *
+ * Windows are handed to a helper thread through an edfs_ra_queue_t,
+ * so that the reader does not wait for them.
+ */
+
+#define EDFS_RA_SEQ_READS     2
+#define EDFS_RA_MIN_BLOCKS    4
+#define EDFS_RA_MAX_BLOCKS    32     /* default maximum window */
+
+/* Requests that can be pending for the helper thread. */
+#define EDFS_RA_QUEUE_SIZE    64
+
+typedef struct
+{
+  pthread_mutex_t lock;       /* reads on one handle may run in parallel */
+  off_t    next_offset;       /* where the previous read ended */
+  uint32_t seq_reads;         /* reads in a row that continued there */
+  uint32_t end;               /* first block past the last window */
+  uint32_t window;            /* size of the next window; 0: off */
+} edfs_ra_t;
+
+void           edfs_ra_init               (edfs_ra_t      *ra);
+void           edfs_ra_destroy            (edfs_ra_t      *ra);
+
+/* Record a read of @size bytes at @offset in a file of @file_size
+ * bytes. Returns true when a window is due, and stores the first
+ * logical block to read ahead and the number of blocks in *first and
+ * *count. @max_window caps the window; 0 disables read-ahead.
+ */
+bool           edfs_ra_update             (edfs_ra_t      *ra,
+                                           off_t           offset,
+                                           size_t          size,
+                                           uint32_t        file_size,
+                                           uint16_t        block_size,
+                                           uint32_t        max_window,
+                                           uint32_t       *first,
+                                           uint32_t       *count);
+
+
+/* Called by the helper thread to load @count blocks of inode @inumber
+ * starting at logical block @first.
+ */
+typedef void (*edfs_ra_fn)(void           *userdata,
+                           edfs_inumber_t  inumber,
+                           uint32_t        first,
+                           uint32_t        count);
+
+typedef struct
+{
+  uint64_t windows;   /* windows issued */
+  uint64_t dropped;   /* windows dropped because the queue was full */
+} edfs_ra_stats_t;
+
+typedef struct _edfs_ra_queue edfs_ra_queue_t;
+
+/* Start the helper thread. Returns NULL if it could not be started;
+ * callers then read ahead synchronously.
+ */
+edfs_ra_queue_t *edfs_ra_queue_new        (edfs_ra_fn      fn,
+                                           void           *userdata);
+
+/* Stop the helper thread; pending windows are dropped. */
+void           edfs_ra_queue_free         (edfs_ra_queue_t *queue);
+
+/* Queue a window. Never blocks: when the queue is full the window is
+ * dropped and false is returned.
+ */
+bool           edfs_ra_queue_submit       (edfs_ra_queue_t *queue,
+                                           edfs_inumber_t   inumber,
+                                           uint32_t         first,
+                                           uint32_t         count);
+
+void           edfs_ra_queue_get_stats    (edfs_ra_queue_t *queue,
+                                           edfs_ra_stats_t *stats);
+void           edfs_ra_queue_print_stats  (edfs_ra_queue_t *queue,
+                                           FILE            *out);
+
+#endif /* __EDFS_READAHEAD_H__ */
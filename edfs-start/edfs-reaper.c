@@ -0,0 +1,159 @@
+/* EdFS -- An educational file system
+ *
+ * Copyright (C) 2019  Leiden University, The Netherlands.
+ */
+
+#include "edfs-reaper.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+
+struct _edfs_reaper
+{
+  edfs_reap_fn     fn;
+  void            *userdata;
+
+  /* Ring buffer of pending inodes. */
+  edfs_inumber_t   pending[EDFS_REAPER_QUEUE_SIZE];
+  size_t           head;
+  size_t           n_pending;
+  bool             stop;
+  bool             stopped;     /* thread was joined */
+
+  pthread_t        thread;
+  pthread_mutex_t  lock;
+  pthread_cond_t   cond;
+
+  edfs_reaper_stats_t stats;
+};
+
+static void *
+edfs_reaper_thread(void *data)
+{
+  edfs_reaper_t *r = data;
+
+  pthread_mutex_lock(&r->lock);
+  while (r->n_pending > 0 || !r->stop)
+    {
+      if (r->n_pending == 0)
+        {
+          pthread_cond_wait(&r->cond, &r->lock);
+          continue;
+        }
+
+      edfs_inumber_t inumber = r->pending[r->head];
+      r->head = (r->head + 1) % EDFS_REAPER_QUEUE_SIZE;
+      r->n_pending--;
+
+      pthread_mutex_unlock(&r->lock);
+      uint64_t batches = 1;
+      while (r->fn(r->userdata, inumber))
+        batches++;
+      pthread_mutex_lock(&r->lock);
+
+      r->stats.inodes++;
+      r->stats.batches += batches;
+    }
+  pthread_mutex_unlock(&r->lock);
+
+  return NULL;
+}
+
+edfs_reaper_t *
+edfs_reaper_new(edfs_reap_fn fn, void *userdata)
+{
+  edfs_reaper_t *r = calloc(1, sizeof(edfs_reaper_t));
+  if (!r)
+    return NULL;
+
+  r->fn = fn;
+  r->userdata = userdata;
+  pthread_mutex_init(&r->lock, NULL);
+  pthread_cond_init(&r->cond, NULL);
+
+  if (pthread_create(&r->thread, NULL, edfs_reaper_thread, r) != 0)
+    {
+      pthread_cond_destroy(&r->cond);
+      pthread_mutex_destroy(&r->lock);
+      free(r);
+      return NULL;
+    }
+
+  return r;
+}
+
+void
+edfs_reaper_stop(edfs_reaper_t *r)
+{
+  if (!r || r->stopped)
+    return;
+
+  pthread_mutex_lock(&r->lock);
+  r->stop = true;
+  pthread_cond_signal(&r->cond);
+  pthread_mutex_unlock(&r->lock);
+
+  pthread_join(r->thread, NULL);
+  r->stopped = true;
+}
+
+void
+edfs_reaper_free(edfs_reaper_t *r)
+{
+  if (!r)
+    return;
+
+  edfs_reaper_stop(r);
+
+  pthread_cond_destroy(&r->cond);
+  pthread_mutex_destroy(&r->lock);
+  free(r);
+}
+
+bool
+edfs_reaper_submit(edfs_reaper_t *r, edfs_inumber_t inumber)
+{
+  bool queued = false;
+
+  pthread_mutex_lock(&r->lock);
+  if (!r->stop && r->n_pending < EDFS_REAPER_QUEUE_SIZE)
+    {
+      size_t tail = (r->head + r->n_pending) % EDFS_REAPER_QUEUE_SIZE;
+
+      r->pending[tail] = inumber;
+      r->n_pending++;
+      pthread_cond_signal(&r->cond);
+      queued = true;
+    }
+  else
+    r->stats.overflow++;
+  pthread_mutex_unlock(&r->lock);
+
+  return queued;
+}
+
+void
+edfs_reaper_get_stats(edfs_reaper_t *r, edfs_reaper_stats_t *stats)
+{
+  if (!r)
+    {
+      memset(stats, 0, sizeof(edfs_reaper_stats_t));
+      return;
+    }
+
+  pthread_mutex_lock(&r->lock);
+  *stats = r->stats;
+  pthread_mutex_unlock(&r->lock);
+}
+
+void
+edfs_reaper_print_stats(edfs_reaper_t *r, FILE *out)
+{
+  edfs_reaper_stats_t s;
+  edfs_reaper_get_stats(r, &s);
+
+  fprintf(out, "reaper: %llu inodes in %llu batches, %llu released inline\n",
+          (unsigned long long)s.inodes, (unsigned long long)s.batches,
+          (unsigned long long)s.overflow);
+}
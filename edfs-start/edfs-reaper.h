@@ -0,0 +1,76 @@
+/* EdFS -- An educational file system
+ *
+ * Copyright (C) 2019  Leiden University, The Netherlands.
+ */
+
+#ifndef __EDFS_REAPER_H__
+#define __EDFS_REAPER_H__
+
+#include "edfs.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <pthread.h>
+
+
+/*
+ * Background release of removed inodes
+ *
+ * Freeing the blocks of a large file takes time in proportion to its
+ * size. Instead of doing so while an unlink waits, a removed inode can
+ * be handed to a helper thread through an edfs_reaper_t. The thread
+ * frees the blocks in batches of EDFS_REAPER_BATCH, so that others
+ * are not kept from the inode's lock for long, and then the inode.
+ *
+ * The inode is marked EDFS_INODE_FLAG_ORPHAN when it is removed from
+ * its directory; whatever is still pending when the file system goes
+ * away is freed at the next mount (edfs_recover_orphans()).
+ */
+
+/* Data blocks freed per batch. */
+#define EDFS_REAPER_BATCH       256
+
+/* Inodes that can be pending for the helper thread. */
+#define EDFS_REAPER_QUEUE_SIZE  256
+
+/* Called by the helper thread to free the next batch of blocks of
+ * inode @inumber. Returns true while blocks remain.
+ */
+typedef bool (*edfs_reap_fn)(void           *userdata,
+                             edfs_inumber_t  inumber);
+
+typedef struct
+{
+  uint64_t inodes;    /* inodes released by the helper thread */
+  uint64_t batches;   /* calls of the edfs_reap_fn */
+  uint64_t overflow;  /* inodes not queued: queue full or stopped */
+} edfs_reaper_stats_t;
+
+typedef struct _edfs_reaper edfs_reaper_t;
+
+/* Start the helper thread. Returns NULL if it could not be started;
+ * callers then release inodes themselves.
+ */
+edfs_reaper_t *edfs_reaper_new            (edfs_reap_fn    fn,
+                                           void           *userdata);
+
+/* Release the inodes that are still pending, then stop the helper
+ * thread. The statistics remain available until edfs_reaper_free().
+ */
+void           edfs_reaper_stop           (edfs_reaper_t  *reaper);
+void           edfs_reaper_free           (edfs_reaper_t  *reaper);
+
+/* Queue inode @inumber. Never blocks: when the queue is full, or the
+ * thread was stopped, false is returned and the caller must release
+ * the inode itself.
+ */
+bool           edfs_reaper_submit         (edfs_reaper_t  *reaper,
+                                           edfs_inumber_t  inumber);
+
+void           edfs_reaper_get_stats      (edfs_reaper_t       *reaper,
+                                           edfs_reaper_stats_t *stats);
+void           edfs_reaper_print_stats    (edfs_reaper_t       *reaper,
+                                           FILE                *out);
+
+#endif /* __EDFS_REAPER_H__ */
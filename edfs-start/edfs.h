@@ -84,13 +84,19 @@ typedef enum
                                  * compatibility.
                                  */
 
-/* Padded to be 16 bytes in size, with 5 reserved bytes available for
+/* Flags of an inode. */
+#define EDFS_INODE_FLAG_ORPHAN  (1 << 0)   /* removed from its directory,
+                                            * blocks not yet freed
+                                            */
+
+/* Padded to be 16 bytes in size, with 6 reserved bytes available for
  * future expansion.
  */
 typedef struct
 {
   edfs_inode_type_t type : 8;
-  uint8_t reserved[3];
+  uint8_t flags;
+  uint8_t reserved[2];
 
   uint32_t size;
 
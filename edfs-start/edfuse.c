@@ -7,791 +7,1293 @@
 
 
 #include "edfs-common.h"
+#include "edfs-readahead.h"
+#include "edfs-reaper.h"
 
 
-#include <fuse.h>
+#include <fuse_lowlevel.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <errno.h>
 #include <unistd.h>
 #include <limits.h>
-#include <utime.h>
 
 #include <stdbool.h>
 
-/* ---------- local helpers for directory scans ---------------------- */
+/* Mount options, see edfs_opts below. */
+struct edfs_options
+{
+  const char *image;
+  int show_stats;           /* -o stats: print cache counters on unmount */
+  double entry_timeout;     /* seconds the kernel may cache a name */
+  double attr_timeout;      /* seconds the kernel may cache attributes */
+  unsigned readahead;       /* maximum read-ahead window in blocks */
+  int async_unlink;         /* -o async_unlink: free blocks in the background */
+
+  edfs_image_options_t image_options;
+};
+
+static struct edfs_options edfs_options =
+{
+  .entry_timeout = 1.0,
+  .attr_timeout  = 1.0,
+  .readahead     = EDFS_RA_MAX_BLOCKS,
+};
+
+
+/* The kernel refers to inodes by number and keeps a reference for
+ * every entry we hand out (lookup, mkdir, create) until it sends a
+ * forget. An inode that is removed from its directory while the kernel
+ * still knows about it is only released when the last reference goes.
+ *
+ * In multithreaded mode every operation holds the lock of the inode it
+ * works on: shared for getattr, read, lookup and readdir, exclusive
+ * for anything that modifies the inode, its blocks or, for a
+ * directory, its entries. An operation that needs a directory and an
+ * entry in it locks the directory first.
+ *
+ * While a file is open its inode is kept in the node, so that reads
+ * and writes do not go through the inode table. The copy is
+ * protected by the node's lock like the inode itself, and so is the
+ * data of small writes whose blocks have not been allocated yet (see
+ * edfs_write_delayed()). That data is written when a handle is
+ * flushed, synced or released, and before a truncate.
+ */
+typedef struct
+{
+  pthread_rwlock_t lock;
+  uint64_t nlookup;         /* references held by the kernel */
+  bool     unlinked;        /* no longer in any directory */
+  uint32_t n_open;          /* open handles; inode is valid if > 0 */
+  edfs_inode_t inode;
+  edfs_delalloc_t da;       /* delayed data; valid if n_open > 0 */
+} edfs_node_t;
 
-/* Context used when we search a directory for one specific name. */
-typedef struct {
-  const char    *want;
+/* State of an open file, stored in fuse_file_info->fh. */
+typedef struct
+{
   edfs_inumber_t inumber;
-  bool           found;
-} edfs_lookup_ctx_t;
+  bool           map_pinned;   /* holds a pin on the inode's block map */
+  edfs_ra_t      ra;           /* sequential read detection */
+} edfs_file_t;
 
-/* Callback: stop when filename matches ctx->want. */
-static bool
-lookup_cb(const edfs_dir_entry_t *de, void *ud)
+typedef struct
+{
+  edfs_image_t   *img;
+  edfs_node_t    *nodes;      /* indexed by inumber */
+  pthread_mutex_t node_lock;  /* nlookup and unlinked of all nodes */
+  edfs_ra_queue_t *ra_queue;  /* NULL: read ahead synchronously */
+  edfs_reaper_t   *reaper;    /* NULL: release inodes synchronously */
+} edfs_mount_t;
+
+static inline edfs_mount_t *
+get_edfs_mount(fuse_req_t req)
+{
+  return (edfs_mount_t *)fuse_req_userdata(req);
+}
+
+static inline edfs_image_t *
+get_edfs_image(fuse_req_t req)
+{
+  return get_edfs_mount(req)->img;
+}
+
+/* FUSE always uses 1 for the root directory; EdFS records the root in
+ * the super block. Swap the two numbers, all others map to themselves.
+ */
+static inline edfs_inumber_t
+edfs_ino_to_inumber(edfs_image_t *img, fuse_ino_t ino)
 {
-  edfs_lookup_ctx_t *ctx = ud;
-  if (strcmp(de->filename, ctx->want) == 0)
+  if (ino == FUSE_ROOT_ID)
+    return img->sb.root_inumber;
+  if (ino == img->sb.root_inumber)
+    return FUSE_ROOT_ID;
+  return ino;
+}
+
+static inline fuse_ino_t
+edfs_inumber_to_ino(edfs_image_t *img, edfs_inumber_t inumber)
+{
+  return edfs_ino_to_inumber(img, inumber);
+}
+
+/* Lock inode @inumber, shared or for writing, and read it into
+ * @inode. Returns 0 on success or -ENOENT if there is no such inode,
+ * in which case nothing is locked.
+ */
+static int
+edfs_lock_inumber(edfs_mount_t   *mount,
+                  edfs_inumber_t  inumber,
+                  bool            write,
+                  edfs_inode_t   *inode)
+{
+  if (inumber == 0 || inumber >= mount->img->sb.inode_table_n_inodes)
+    return -ENOENT;
+
+  pthread_rwlock_t *lock = &mount->nodes[inumber].lock;
+  if (write)
+    pthread_rwlock_wrlock(lock);
+  else
+    pthread_rwlock_rdlock(lock);
+
+  if (mount->nodes[inumber].n_open > 0)
     {
-      ctx->inumber = de->inumber;
-      ctx->found   = true;
-      return true;                       /* stop scanning */
+      *inode = mount->nodes[inumber].inode;
+      return 0;
     }
-  return false;                          /* continue */
-}
 
-/* Callback used by readdir: feed every name to FUSE filler. */
-typedef struct {
-  fuse_fill_dir_t filler;
-  void           *buf;
-} edfs_readdir_ctx_t;
+  inode->inumber = inumber;
+  edfs_read_inode(mount->img, inode);
+  if (inode->inode.type == EDFS_INODE_TYPE_FREE)
+    {
+      pthread_rwlock_unlock(lock);
+      return -ENOENT;
+    }
 
-static bool
-readdir_cb(const edfs_dir_entry_t *de, void *ud)
+  return 0;
+}
+
+/* Same, for the inode the kernel refers to as @ino. */
+static int
+edfs_lock_inode(edfs_mount_t *mount,
+                fuse_ino_t    ino,
+                bool          write,
+                edfs_inode_t *inode)
 {
-  edfs_readdir_ctx_t *ctx = ud;
-  ctx->filler(ctx->buf, de->filename, NULL, 0);
-  return false;                          /* keep going */
+  return edfs_lock_inumber(mount, edfs_ino_to_inumber(mount->img, ino),
+                           write, inode);
 }
 
-/* Callback used by rmdir: if we see *any* entry, flag directory as non-empty. */
-static bool
-mark_nonempty_cb(const edfs_dir_entry_t *e, void *ud)
+static void
+edfs_unlock_inode(edfs_mount_t *mount, const edfs_inode_t *inode)
 {
-  bool *flag = ud;
-  *flag = true;
-  return true;          /* stop scanning as soon as one entry is found */
+  pthread_rwlock_unlock(&mount->nodes[inode->inumber].lock);
 }
 
-static inline edfs_image_t *
-get_edfs_image(void)
+static inline edfs_file_t *
+get_edfs_file(struct fuse_file_info *fi)
 {
-  return (edfs_image_t *)fuse_get_context()->private_data;
+  return (edfs_file_t *)(uintptr_t)fi->fh;
 }
 
+/* Attach @file to inode @inumber and store it in @fi. */
+static void
+edfs_file_attach(edfs_mount_t          *mount,
+                 edfs_inumber_t         inumber,
+                 edfs_file_t           *file,
+                 struct fuse_file_info *fi)
+{
+  edfs_node_t *node = &mount->nodes[inumber];
 
+  pthread_rwlock_wrlock(&node->lock);
+  if (node->n_open++ == 0)
+    {
+      node->inode.inumber = inumber;
+      edfs_read_inode(mount->img, &node->inode);
+      edfs_delalloc_init(&node->da);
+    }
+  pthread_rwlock_unlock(&node->lock);
 
-/* Searches the file system hierarchy to find the inode for
- * the given path. Returns true if the operation succeeded.
- *
- * IMPORTANT: TODO: this function is not yet complete, you have to
- * finish it! See below and Section 4.1 of the Appendices PDF.
+  file->inumber = inumber;
+  file->map_pinned = edfs_pin_block_map(mount->img, inumber);
+  edfs_ra_init(&file->ra);
+  fi->fh = (uintptr_t)file;
+}
+
+/* Find @name in directory @dir. The dentry cache is consulted first;
+ * only on a miss the directory index is, and the outcome is
+ * remembered (also when the name does not exist). Returns true and
+ * sets *child when found.
  */
 static bool
-edfs_find_inode(edfs_image_t *img,
-                const char *path,
-                edfs_inode_t *inode)
+edfs_lookup_name(edfs_image_t       *img,
+                 const edfs_inode_t *dir,
+                 const char         *name,
+                 edfs_inumber_t     *child)
 {
-  if (strlen(path) == 0 || path[0] != '/')
+  size_t len = strlen(name);
+  if (len == 0 || len >= EDFS_FILENAME_SIZE)
     return false;
 
-  edfs_inode_t current_inode;
-  edfs_read_root_inode(img, &current_inode);
-
-  while (path && (path = strchr(path, '/')))
+  if (!edfs_dcache_lookup(img->dcache, dir->inumber, name, len, child))
     {
-      /* Ignore path separator */
-      while (*path == '/')
-        path++;
-
-      /* Find end of new component */
-      char *end = strchr(path, '/');
-      if (!end)
-        {
-          int len = strnlen(path, PATH_MAX);
-          if (len > 0)
-            end = (char *)&path[len];
-          else
-            {
-              /* We are done: return current entry. */
-              *inode = current_inode;
-              return true;
-            }
-        }
+      edfs_dir_pos_t pos;
+      int rc = edfs_dir_lookup(img, dir, name, &pos);
 
-      /* Verify length of component is not larger than maximum allowed
-       * filename size.
-       */
-      int len = end - path;
-      if (len >= EDFS_FILENAME_SIZE)
+      if (rc < 0 && rc != -ENOENT)
         return false;
 
-      /* Within the directory pointed to by parent_inode/current_inode,
-       * find the inode number for path, len.
-       */
-      edfs_dir_entry_t direntry = { 0, };
-      strncpy(direntry.filename, path, len);
-      direntry.filename[len] = 0;
-
-      if (direntry.filename[0] != 0)
-        {
-          edfs_lookup_ctx_t ctx = { .want = direntry.filename,
-            .inumber = 0,
-            .found = false };
+      *child = rc == 0 ? pos.inumber : 0;
+      edfs_dcache_insert(img->dcache, dir->inumber, name, len, *child);
+    }
 
-          edfs_scan_directory(img, &current_inode, lookup_cb, &ctx);
+  return *child != 0;
+}
 
-          bool found = ctx.found;
-          direntry.inumber = ctx.inumber;
+/* Free the blocks and the inode of a removed file or directory, or
+ * leave that to the reaper thread.
+ */
+static void
+edfs_release_inode(edfs_mount_t *mount, edfs_inumber_t inumber)
+{
+  if (mount->reaper && edfs_reaper_submit(mount->reaper, inumber))
+    return;
 
-          if (found)
-            {
-              /* Found what we were looking for, now get our new inode. */
-              current_inode.inumber = direntry.inumber;
-              edfs_read_inode(img, &current_inode);
-            }
-          else
-            return false;
-        }
+  edfs_reap_inode(mount->img, inumber, 0);
+}
 
-      path = end;
-    }
+/* Free the next batch of blocks of a removed inode, for the reaper
+ * thread. The inode lock is dropped between batches.
+ */
+static bool
+edfs_reap_node(void *userdata, edfs_inumber_t inumber)
+{
+  edfs_mount_t *mount = userdata;
+  edfs_node_t *node = &mount->nodes[inumber];
 
-  *inode = current_inode;
+  pthread_rwlock_wrlock(&node->lock);
+  int rc = edfs_reap_inode(mount->img, inumber, EDFS_REAPER_BATCH);
+  pthread_rwlock_unlock(&node->lock);
 
-  return true;
+  return rc > 0;
 }
 
-static inline void
-drop_trailing_slashes(char *path_copy)
+/* Release a removed inode that the kernel has forgotten. Nobody can
+ * reach it through a name or a handle any more, but the read-ahead
+ * thread may still look at it, hence the lock.
+ */
+static void
+edfs_node_release(edfs_mount_t *mount, edfs_inumber_t inumber)
 {
-  int len = strlen(path_copy);
-  while (len > 0 && path_copy[len-1] == '/')
-    {
-      path_copy[len-1] = 0;
-      len--;
-    }
+  edfs_node_t *node = &mount->nodes[inumber];
+
+  pthread_rwlock_wrlock(&node->lock);
+  edfs_release_inode(mount, inumber);
+  pthread_rwlock_unlock(&node->lock);
 }
 
-/* Return the parent inode, for the containing directory of the inode (file or
- * directory) specified in @path. Returns 0 on success, error code otherwise.
- *
- * (This function is not yet used, but will be useful for your
- * implementation.)
+/* Called when @inumber was removed from its directory, with the
+ * inode locked.
  */
-static int
-edfs_get_parent_inode(edfs_image_t *img,
-                      const char *path,
-                      edfs_inode_t *parent_inode)
+static void
+edfs_node_unlinked(edfs_mount_t *mount, edfs_inumber_t inumber)
 {
-  int res;
-  char *path_copy = strdup(path);
+  edfs_node_t *node = &mount->nodes[inumber];
 
-  drop_trailing_slashes(path_copy);
+  pthread_mutex_lock(&mount->node_lock);
+  bool in_use = node->nlookup > 0;
+  if (in_use)
+    node->unlinked = true;
+  pthread_mutex_unlock(&mount->node_lock);
 
-  if (strlen(path_copy) == 0)
-    {
-      res = -EINVAL;
-      goto out;
-    }
+  if (!in_use)
+    edfs_release_inode(mount, inumber);
+}
+
+static void
+edfs_node_forget(edfs_mount_t *mount, fuse_ino_t ino, uint64_t nlookup)
+{
+  edfs_inumber_t inumber = edfs_ino_to_inumber(mount->img, ino);
+  if (inumber >= mount->img->sb.inode_table_n_inodes)
+    return;
+
+  edfs_node_t *node = &mount->nodes[inumber];
 
-  /* Extract parent component */
-  char *sep = strrchr(path_copy, '/');
-  if (!sep)
+  pthread_mutex_lock(&mount->node_lock);
+  node->nlookup = nlookup < node->nlookup ? node->nlookup - nlookup : 0;
+  bool release = node->nlookup == 0 && node->unlinked;
+  if (release)
+    node->unlinked = false;
+  pthread_mutex_unlock(&mount->node_lock);
+
+  if (release)
+    edfs_node_release(mount, inumber);
+}
+
+/* Fill @stbuf from @inode. At least mode, nlink and size must be
+ * filled here, otherwise the "ls" listings appear busted. We assume
+ * all files and directories have rw permissions for owner and group.
+ */
+static void
+edfs_fill_stat(edfs_mount_t       *mount,
+               const edfs_inode_t *inode,
+               struct stat        *stbuf)
+{
+  pthread_mutex_lock(&mount->node_lock);
+  bool linked = !mount->nodes[inode->inumber].unlinked;
+  pthread_mutex_unlock(&mount->node_lock);
+
+  memset(stbuf, 0, sizeof(struct stat));
+  if (inode->inumber == mount->img->sb.root_inumber)
     {
-      res = -EINVAL;
-      goto out;
+      stbuf->st_mode = S_IFDIR | 0755;
+      stbuf->st_nlink = 2;
     }
-
-  if (path_copy == sep)
+  else if (edfs_disk_inode_is_directory(&inode->inode))
     {
-      /* The parent is the root directory. */
-      edfs_read_root_inode(img, parent_inode);
-      res = 0;
-      goto out;
+      stbuf->st_mode = S_IFDIR | 0770;
+      stbuf->st_nlink = linked ? 2 : 0;
     }
-
-  /* If not the root directory for certain, start a usual search. */
-  *sep = 0;
-  char *dirname = path_copy;
-
-  if (!edfs_find_inode(img, dirname, parent_inode))
+  else
     {
-      res = -ENOENT;
-      goto out;
+      stbuf->st_mode = S_IFREG | 0660;
+      stbuf->st_nlink = linked ? 1 : 0;
     }
+  stbuf->st_size = inode->inode.size;
+  stbuf->st_ino = edfs_inumber_to_ino(mount->img, inode->inumber);
+}
 
-  res = 0;
-
-out:
-  free(path_copy);
-
-  return res;
+/* Describe @inode for an entry reply and account for the reference the
+ * kernel takes on it.
+ */
+static void
+edfs_fill_entry(edfs_mount_t            *mount,
+                const edfs_inode_t      *inode,
+                struct fuse_entry_param *e)
+{
+  memset(e, 0, sizeof(struct fuse_entry_param));
+  e->ino = edfs_inumber_to_ino(mount->img, inode->inumber);
+  e->attr_timeout = edfs_options.attr_timeout;
+  e->entry_timeout = edfs_options.entry_timeout;
+  edfs_fill_stat(mount, inode, &e->attr);
+
+  pthread_mutex_lock(&mount->node_lock);
+  mount->nodes[inode->inumber].nlookup++;
+  pthread_mutex_unlock(&mount->node_lock);
 }
 
-/* Separates the basename (the actual name of the file) from the path.
- * The return value must be freed.
- *
- * (This function is not yet used, but will be useful for your
- * implementation.)
+
+/*
+ * Implementation of necessary FUSE operations.
  */
-static char *
-edfs_get_basename(const char *path)
+
+static void
+edfuse_lookup(fuse_req_t req, fuse_ino_t parent_ino, const char *name)
 {
-  char *res = NULL;
-  char *path_copy = strdup(path);
+  edfs_mount_t *mount = get_edfs_mount(req);
+  edfs_image_t *img = mount->img;
+  edfs_inode_t parent;
 
-  drop_trailing_slashes(path_copy);
+  int rc = edfs_lock_inode(mount, parent_ino, false, &parent);
+  if (rc < 0) { fuse_reply_err(req, -rc); return; }
 
-  if (strlen(path_copy) == 0)
-    {
-      res = NULL;
-      goto out;
-    }
+  /* A zero inode number lets the kernel cache a negative result. */
+  struct fuse_entry_param e = { .ino = 0,
+                                .entry_timeout = edfs_options.entry_timeout };
+  edfs_inumber_t child;
 
-  /* Find beginning of basename. */
-  char *sep = strrchr(path_copy, '/');
-  if (!sep)
+  if (!edfs_disk_inode_is_directory(&parent.inode))
+    rc = -ENOTDIR;
+  else if (strlen(name) >= EDFS_FILENAME_SIZE)
+    rc = -ENAMETOOLONG;
+  else if (edfs_lookup_name(img, &parent, name, &child))
     {
-      res = NULL;
-      goto out;
+      edfs_inode_t inode = { .inumber = child };
+      edfs_read_inode(img, &inode);
+      edfs_fill_entry(mount, &inode, &e);
     }
 
-  res = strdup(sep + 1);
+  edfs_unlock_inode(mount, &parent);
 
-out:
-  free(path_copy);
+  if (rc < 0)
+    fuse_reply_err(req, -rc);
+  else
+    fuse_reply_entry(req, &e);
+}
 
-  return res;
+static void
+edfuse_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+{
+  edfs_node_forget(get_edfs_mount(req), ino, nlookup);
+  fuse_reply_none(req);
 }
 
+static void
+edfuse_forget_multi(fuse_req_t req, size_t count,
+                    struct fuse_forget_data *forgets)
+{
+  for (size_t i = 0; i < count; ++i)
+    edfs_node_forget(get_edfs_mount(req), forgets[i].ino, forgets[i].nlookup);
+  fuse_reply_none(req);
+}
 
-/*
- * Implementation of necessary FUSE operations.
+/* Directory offsets are 0 for ".", 1 for ".." and 2 + slot number for
+ * the entries, so that they stay valid while entries are removed
+ * during a listing.
  */
-
-static int
-edfuse_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-               off_t offset, struct fuse_file_info *fi)
+static void
+edfuse_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+               struct fuse_file_info *fi)
 {
-  edfs_image_t *img = get_edfs_image();
-  edfs_inode_t inode = { 0, };
+  edfs_mount_t *mount = get_edfs_mount(req);
+  edfs_image_t *img = mount->img;
+  edfs_inode_t inode;
 
-  if (!edfs_find_inode(img, path, &inode))
-    return -ENOENT;
+  int rc = edfs_lock_inode(mount, ino, false, &inode);
+  if (rc < 0) { fuse_reply_err(req, -rc); return; }
 
+  char *buf = NULL;
   if (!edfs_disk_inode_is_directory(&inode.inode))
-    return -ENOTDIR;
+    rc = -ENOTDIR;
+  else if (!(buf = malloc(size)))
+    rc = -ENOMEM;
 
-  filler(buf, ".", NULL, 0);
-  filler(buf, "..", NULL, 0);
+  if (rc < 0)
+    {
+      edfs_unlock_inode(mount, &inode);
+      fuse_reply_err(req, -rc);
+      return;
+    }
 
-  edfs_readdir_ctx_t ctx = { .filler = filler, .buf = buf };
-  edfs_scan_directory(img, &inode, readdir_cb, &ctx);
+  const int ents_per_blk = edfs_get_n_dir_entries_per_block(&img->sb);
+  const off_t n_offsets = 2 + EDFS_INODE_N_BLOCKS * ents_per_blk;
+  size_t pos = 0;
 
+  for (off_t i = off; i < n_offsets; ++i)
+    {
+      char name[EDFS_FILENAME_SIZE];
+      struct stat st = { 0, };
 
-  return 0;
+      if (i < 2)
+        {
+          strcpy(name, i == 0 ? "." : "..");
+          st.st_ino = ino;
+          st.st_mode = S_IFDIR;
+        }
+      else
+        {
+          int slot = i - 2;
+          edfs_block_t blk = inode.inode.blocks[slot / ents_per_blk];
+          edfs_dir_entry_t de;
+
+          if (blk == EDFS_BLOCK_INVALID)
+            continue;
+          if (edfs_bcache_read(img->bcache, blk,
+                               (slot % ents_per_blk) * sizeof(de),
+                               sizeof(de), &de) < 0)
+            break;
+          if (edfs_dir_entry_is_empty(&de))
+            continue;
+
+          size_t len = strnlen(de.filename, EDFS_FILENAME_SIZE - 1);
+          memcpy(name, de.filename, len);
+          name[len] = 0;
+
+          edfs_inode_t child = { .inumber = de.inumber };
+          edfs_read_inode(img, &child);
+          st.st_ino = edfs_inumber_to_ino(img, child.inumber);
+          st.st_mode = edfs_disk_inode_is_directory(&child.inode)
+                       ? S_IFDIR : S_IFREG;
+
+          /* A listing is usually followed by a lookup of every name
+           * (ls -l), so enter them in the dentry cache.
+           */
+          edfs_dcache_insert(img->dcache, inode.inumber, name, len,
+                             child.inumber);
+        }
+
+      size_t len = fuse_add_direntry(req, buf + pos, size - pos,
+                                     name, &st, i + 1);
+      if (len > size - pos)
+        break;
+      pos += len;
+    }
+
+  edfs_unlock_inode(mount, &inode);
+
+  fuse_reply_buf(req, buf, pos);
+  free(buf);
 }
 
+/* Create @name in directory @parent_ino as a new inode of @type and
+ * describe it in @e. Returns 0 on success or a negative errno.
+ */
 static int
-edfuse_mkdir(const char *path, mode_t mode)
+edfs_make_node(fuse_req_t               req,
+               fuse_ino_t               parent_ino,
+               const char              *name,
+               edfs_inode_type_t        type,
+               struct fuse_entry_param *e)
 {
-  edfs_image_t *img = get_edfs_image();
+  edfs_mount_t *mount = get_edfs_mount(req);
+  edfs_image_t *img = mount->img;
 
-  /* 1. split path */
+  /* 1. find and lock parent */
   edfs_inode_t parent;
-  int rc = edfs_get_parent_inode(img, path, &parent);
+  int rc = edfs_lock_inode(mount, parent_ino, true, &parent);
   if (rc < 0) return rc;
 
-  if (!edfs_disk_inode_is_directory(&parent.inode))
-    return -ENOTDIR;
-
-  char *basename = edfs_get_basename(path);
-  if (!basename) return -EINVAL;
-
-  /* 2. ensure name not already in use */
-  edfs_lookup_ctx_t lctx = { .want = basename, .found = false };
-  edfs_scan_directory(img, &parent, lookup_cb, &lctx);
-  if (lctx.found) { free(basename); return -EEXIST; }
+  size_t len = strlen(name);
+  edfs_dir_pos_t pos;
+  edfs_inode_t child;
 
+  /* 2. ensure name not already in use, and reserve a slot for it */
+  rc = edfs_dir_lookup_or_reserve(img, &parent, name, &pos);
+  if (rc == -EEXIST)
+    edfs_dcache_insert(img->dcache, parent.inumber, name, len, pos.inumber);
   /* 3. allocate new inode */
-  edfs_inode_t child;
-  rc = edfs_new_inode(img, &child, EDFS_INODE_TYPE_DIRECTORY);
-  if (rc < 0) { free(basename); return rc; }
+  else if (rc == 0 && (rc = edfs_new_inode(img, &child, type)) < 0)
+    edfs_dir_cancel(img, &parent, &pos);
+  else if (rc == 0)
+    {
+      child.inode.size = 0;             /* directories ignore size */
+      edfs_write_inode(img, &child);
 
-  child.inode.size = 0;                 /* directories ignore size */
-  rc = edfs_write_inode(img, &child);
-  if (rc < 0) { free(basename); return rc; }
+      /* 4. fill in the dir entry in the parent */
+      rc = edfs_dir_commit(img, &parent, &pos, name, child.inumber);
+      if (rc < 0)
+        edfs_clear_inode(img, &child);  /* release the reserved inode */
+      else
+        {
+          edfs_dcache_insert(img->dcache, parent.inumber, name, len,
+                             child.inumber);
+          edfs_fill_entry(mount, &child, e);
+        }
+    }
 
-  /* 4. add dir entry to parent */
-  rc = edfs_add_dir_entry(img, &parent, basename, child.inumber);
-  free(basename);
-  return rc;
+  edfs_unlock_inode(mount, &parent);
+  return rc < 0 ? rc : 0;
 }
 
-static int
-edfuse_rmdir(const char *path)
+static void
+edfuse_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
+             mode_t mode)
 {
-  edfs_image_t *img = get_edfs_image();
+  struct fuse_entry_param e;
 
-  /* locate inode of dir to remove */
-  edfs_inode_t target;
-  if (!edfs_find_inode(img, path, &target))
-    return -ENOENT;
-
-  if (!edfs_disk_inode_is_directory(&target.inode))
-    return -ENOTDIR;
-
-  /* ensure directory is empty */
-  bool has_child = false;
-  edfs_scan_directory(img, &target, mark_nonempty_cb, &has_child);
-  if (has_child) return -ENOTEMPTY;
+  int rc = edfs_make_node(req, parent, name, EDFS_INODE_TYPE_DIRECTORY, &e);
+  if (rc < 0)
+    fuse_reply_err(req, -rc);
+  else
+    fuse_reply_entry(req, &e);
+}
 
-  /* remove entry from parent directory */
-  edfs_inode_t parent;
-  int rc = edfs_get_parent_inode(img, path, &parent);
-  if (rc < 0) return rc;
+static void
+edfuse_create(fuse_req_t req, fuse_ino_t parent, const char *name,
+              mode_t mode, struct fuse_file_info *fi)
+{
+  edfs_mount_t *mount = get_edfs_mount(req);
+  struct fuse_entry_param e;
 
-  /* overwrite the matching direntry with zeros */
-  const uint16_t bs = img->sb.block_size;
-  const int ents_per_blk = edfs_get_n_dir_entries_per_block(&img->sb);
-  edfs_dir_entry_t *buf = malloc(bs);
-  if (!buf) return -ENOMEM;
+  /* Allocated first: once the file exists, creating it can not fail. */
+  edfs_file_t *file = malloc(sizeof(edfs_file_t));
+  if (!file) { fuse_reply_err(req, ENOMEM); return; }
 
-  for (int i = 0; i < EDFS_INODE_N_BLOCKS; ++i)
+  int rc = edfs_make_node(req, parent, name, EDFS_INODE_TYPE_FILE, &e);
+  if (rc < 0)
     {
-      edfs_block_t blk = parent.inode.blocks[i];
-      if (blk == EDFS_BLOCK_INVALID) continue;
-
-      off_t off = edfs_get_block_offset(&img->sb, blk);
-      pread(img->fd, buf, bs, off);
-
-      for (int j = 0; j < ents_per_blk; ++j)
-        if (buf[j].inumber == target.inumber)
-          {
-            memset(&buf[j], 0, sizeof(edfs_dir_entry_t));
-            pwrite(img->fd, buf, bs, off);
-            free(buf);
-            goto removed;
-          }
+      free(file);
+      fuse_reply_err(req, -rc);
+      return;
     }
-  free(buf);
-  return -EIO;             /* should not happen */
 
-  removed:
-  /* free any blocks owned by the empty directory (there should be none) */
-  for (int i = 0; i < EDFS_INODE_N_BLOCKS; ++i)
-    if (target.inode.blocks[i] != EDFS_BLOCK_INVALID)
-      edfs_free_block(img, target.inode.blocks[i]);
-
-  /* clear inode */
-  rc = edfs_clear_inode(img, &target);
-  return rc;
+  edfs_file_attach(mount, edfs_ino_to_inumber(mount->img, e.ino), file, fi);
+  fuse_reply_create(req, &e, fi);
 }
 
-
-/* Get attributes of @path, fill @stbuf. At least mode, nlink and
- * size must be filled here, otherwise the "ls" listings appear busted.
- * We assume all files and directories have rw permissions for owner and
- * group.
+/* Remove @name from directory @parent_ino: a directory, which must be
+ * empty, if @dir is set and a file otherwise. Since we don't maintain
+ * link count, removing a file's name removes the file. Returns 0 on
+ * success or a negative errno.
  */
 static int
-edfuse_getattr(const char *path, struct stat *stbuf)
+edfs_remove_node(fuse_req_t  req,
+                 fuse_ino_t  parent_ino,
+                 const char *name,
+                 bool        dir)
 {
-  int res = 0;
-  edfs_image_t *img = get_edfs_image();
+  edfs_mount_t *mount = get_edfs_mount(req);
+  edfs_image_t *img = mount->img;
 
-  memset(stbuf, 0, sizeof(struct stat));
-  if (strcmp(path, "/") == 0)
+  /* 1. lock the parent, then the inode to remove */
+  edfs_inode_t parent;
+  int rc = edfs_lock_inode(mount, parent_ino, true, &parent);
+  if (rc < 0) return rc;
+
+  /* The position of the entry is kept for step 3. */
+  edfs_dir_pos_t pos;
+  edfs_inode_t target;
+  rc = edfs_dir_lookup(img, &parent, name, &pos);
+  if (rc == 0)
+    rc = edfs_lock_inumber(mount, pos.inumber, true, &target);
+
+  if (rc < 0)
     {
-      stbuf->st_mode = S_IFDIR | 0755;
-      stbuf->st_nlink = 2;
-      return res;
+      edfs_unlock_inode(mount, &parent);
+      return rc;
     }
 
-  edfs_inode_t inode;
-  if (!edfs_find_inode(img, path, &inode))
-    res = -ENOENT;
-  else
+  /* 2. check the type, and that a directory is empty */
+  if (dir != edfs_disk_inode_is_directory(&target.inode))
+    rc = dir ? -ENOTDIR : -EISDIR;
+  else if (dir)
     {
-      if (edfs_disk_inode_is_directory(&inode.inode))
-        {
-          stbuf->st_mode = S_IFDIR | 0770;
-          stbuf->st_nlink = 2;
-        }
-      else
+      bool empty;
+      rc = edfs_dir_is_empty(img, &target, &empty);
+      if (rc == 0 && !empty)
+        rc = -ENOTEMPTY;
+    }
+
+  /* 3. clear the directory entry */
+  if (rc == 0 && (rc = edfs_remove_dir_entry(img, &parent, &pos)) == 0)
+    {
+      /* the name is gone, and so is everything cached below it */
+      edfs_dcache_insert(img->dcache, parent.inumber, name, strlen(name), 0);
+      if (dir)
+        edfs_dcache_purge_parent(img->dcache, target.inumber);
+
+      /* 4. free the blocks and the inode once no longer in use. The
+       * orphan flag lets the next mount finish that if we do not.
+       * Data an open file holds back is written first, as it can
+       * still be read through the file; the inode must not reach
+       * the table with its size otherwise. Should that fail, the
+       * data is dropped and the size taken back from the table.
+       */
+      edfs_node_t *node = &mount->nodes[target.inumber];
+      if (node->n_open > 0 && node->da.count > 0)
         {
-          stbuf->st_mode = S_IFREG | 0660;
-          stbuf->st_nlink = 1;
+          if (edfs_delalloc_flush(img, &node->inode, &node->da) < 0)
+            {
+              edfs_inode_t stored = { .inumber = target.inumber };
+              edfs_read_inode(img, &stored);
+              edfs_delalloc_destroy(img, &node->da);
+              node->inode.inode.size = stored.inode.size;
+            }
+          target = node->inode;
         }
-      stbuf->st_size = inode.inode.size;
 
-      /* Note that this setting is ignored, unless the FUSE file system
-       * is mounted with the 'use_ino' option.
-       */
-      stbuf->st_ino = inode.inumber;
+      edfs_orphan_inode(img, &target);
+      if (node->n_open > 0)
+        node->inode = target;
+      edfs_node_unlinked(mount, target.inumber);
     }
 
-  return res;
+  edfs_unlock_inode(mount, &target);
+  edfs_unlock_inode(mount, &parent);
+  return rc;
 }
 
-/* Open file at @path. Verify it exists by finding the inode and
- * verify the found inode is not a directory. We do not maintain
- * state of opened files.
- */
-static int
-edfuse_open(const char *path, struct fuse_file_info *fi)
+static void
+edfuse_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
 {
-  edfs_image_t *img = get_edfs_image();
+  fuse_reply_err(req, -edfs_remove_node(req, parent, name, true));
+}
 
+static void
+edfuse_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+  fuse_reply_err(req, -edfs_remove_node(req, parent, name, false));
+}
+
+
+static void
+edfuse_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+  edfs_mount_t *mount = get_edfs_mount(req);
   edfs_inode_t inode;
-  if (!edfs_find_inode(img, path, &inode))
-    return -ENOENT;
 
-  /* Open may only be called on files. */
-  if (edfs_disk_inode_is_directory(&inode.inode))
-    return -EISDIR;
+  int rc = edfs_lock_inode(mount, ino, false, &inode);
+  if (rc < 0) { fuse_reply_err(req, -rc); return; }
 
-  return 0;
+  struct stat stbuf;
+  edfs_fill_stat(mount, &inode, &stbuf);
+  edfs_unlock_inode(mount, &inode);
+
+  fuse_reply_attr(req, &stbuf, edfs_options.attr_timeout);
 }
 
-static int
-edfuse_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+/* Only the size can be changed (truncate, ftruncate); permission,
+ * ownership and time updates are accepted but ignored.
+ */
+static void
+edfuse_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+               int to_set, struct fuse_file_info *fi)
 {
-  edfs_image_t *img = get_edfs_image();
+  edfs_mount_t *mount = get_edfs_mount(req);
+  edfs_inode_t inode;
 
-  /* parent dir */
-  edfs_inode_t parent;
-  int rc = edfs_get_parent_inode(img, path, &parent);
-  if (rc < 0) return rc;
+  int rc = edfs_lock_inode(mount, ino, true, &inode);
+  if (rc < 0) { fuse_reply_err(req, -rc); return; }
 
-  if (!edfs_disk_inode_is_directory(&parent.inode))
-    return -ENOTDIR;
+  if (to_set & FUSE_SET_ATTR_SIZE)
+    {
+      edfs_node_t *node = &mount->nodes[inode.inumber];
 
-  char *name = edfs_get_basename(path);
-  if (!name) return -EINVAL;
+      /* Data held back must have its blocks before they are cut. */
+      if (node->n_open > 0)
+        {
+          rc = edfs_delalloc_flush(mount->img, &node->inode, &node->da);
+          inode = node->inode;
+        }
 
-  /* already exists? */
-  edfs_lookup_ctx_t ctx = { .want = name, .found = false };
-  edfs_scan_directory(img, &parent, lookup_cb, &ctx);
-  if (ctx.found) { free(name); return -EEXIST; }
+      if (rc < 0)
+        ;
+      else if (edfs_disk_inode_is_directory(&inode.inode))
+        rc = -EISDIR;
+      else
+        rc = edfs_truncate_data(mount->img, &inode, attr->st_size);
 
-  /* make new inode */
-  edfs_inode_t child;
-  rc = edfs_new_inode(img, &child, EDFS_INODE_TYPE_FILE);
-  if (rc < 0) { free(name); return rc; }
+      /* Refresh the copy kept for open handles. */
+      if (node->n_open > 0)
+        edfs_read_inode(mount->img, &node->inode);
+    }
 
-  child.inode.size = 0;
-  rc = edfs_write_inode(img, &child);
-  if (rc < 0) { free(name); return rc; }
+  struct stat stbuf;
+  edfs_fill_stat(mount, &inode, &stbuf);
+  edfs_unlock_inode(mount, &inode);
 
-  /* dir entry */
-  rc = edfs_add_dir_entry(img, &parent, name, child.inumber);
-  free(name);
-  return rc;
+  if (rc < 0)
+    fuse_reply_err(req, -rc);
+  else
+    fuse_reply_attr(req, &stbuf, edfs_options.attr_timeout);
 }
 
-
-/* Since we don't maintain link count, we'll treat unlink as a file
- * remove operation.
+/* Open file @ino; verify the inode is not a directory. The inode
+ * stays cached in its node until the handle is released.
  */
-static int
-edfuse_unlink(const char *path)
+static void
+edfuse_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
-  edfs_image_t *img = get_edfs_image();
-
-  /* 1. locate inode */
+  edfs_mount_t *mount = get_edfs_mount(req);
   edfs_inode_t inode;
-  if (!edfs_find_inode(img, path, &inode))
-    return -ENOENT;
 
-  if (edfs_disk_inode_is_directory(&inode.inode))
-    return -EISDIR;
+  int rc = edfs_lock_inode(mount, ino, false, &inode);
+  if (rc < 0) { fuse_reply_err(req, -rc); return; }
 
-  /* 2. free all data blocks */
-  uint16_t bs = img->sb.block_size;
-  uint32_t per_ind = edfs_get_n_blocks_per_indirect_block(&img->sb);
+  bool is_dir = edfs_disk_inode_is_directory(&inode.inode);
+  edfs_unlock_inode(mount, &inode);
 
-  if (edfs_disk_inode_has_indirect(&inode.inode))
-    {
-      for (int slot = 0; slot < EDFS_INODE_N_BLOCKS; ++slot)
-        {
-          edfs_block_t ind_blk = inode.inode.blocks[slot];
-          if (ind_blk == EDFS_BLOCK_INVALID) continue;
+  /* Open may only be called on files. */
+  if (is_dir)
+    { fuse_reply_err(req, EISDIR); return; }
+
+  edfs_file_t *file = malloc(sizeof(edfs_file_t));
+  if (!file)
+    { fuse_reply_err(req, ENOMEM); return; }
 
-          /* read indirect array */
-          edfs_block_t *ary = malloc(bs);
-          pread(img->fd, ary, bs,
-                edfs_get_block_offset(&img->sb, ind_blk));
+  /* The kernel holds a reference on @ino, so it can not be released
+   * between the check above and here.
+   */
+  edfs_file_attach(mount, inode.inumber, file, fi);
+  fuse_reply_open(req, fi);
+}
 
-          for (uint32_t i = 0; i < per_ind; ++i)
-            if (ary[i] != EDFS_BLOCK_INVALID)
-              edfs_free_block(img, ary[i]);
+static void
+edfuse_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+  edfs_mount_t *mount = get_edfs_mount(req);
+  edfs_file_t *file = get_edfs_file(fi);
+  edfs_node_t *node = &mount->nodes[file->inumber];
 
-          free(ary);
-          edfs_free_block(img, ind_blk);
-        }
+  pthread_rwlock_wrlock(&node->lock);
+  if (--node->n_open == 0)
+    {
+      /* Nobody is left to report an error to. */
+      int rc = edfs_delalloc_flush(mount->img, &node->inode, &node->da);
+      if (rc < 0)
+        fprintf(stderr, "warning: data written to inode %u lost: %s\n",
+                file->inumber, strerror(-rc));
+      edfs_delalloc_destroy(mount->img, &node->da);
     }
-  else
+  pthread_rwlock_unlock(&node->lock);
+
+  if (file->map_pinned)
+    edfs_unpin_block_map(mount->img, file->inumber);
+  edfs_ra_destroy(&file->ra);
+  free(file);
+
+  fuse_reply_err(req, 0);
+}
+
+static void
+edfuse_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+            struct fuse_file_info *fi)
+{
+  edfs_mount_t *mount = get_edfs_mount(req);
+  edfs_file_t *file = get_edfs_file(fi);
+  edfs_node_t *node = &mount->nodes[file->inumber];
+
+  /* The reply refers to the image file where it can, so that FUSE
+   * splices the data from the image to the kernel without copying it
+   * through this process. Only holes and modified cached blocks are
+   * copied into the scratch buffer.
+   */
+  const int max_refs = size / mount->img->sb.block_size + 2;
+  char *scratch = malloc(size);
+  edfs_data_ref_t *refs = malloc(max_refs * sizeof(edfs_data_ref_t));
+  struct fuse_bufvec *bufv = malloc(sizeof(struct fuse_bufvec) +
+                                    max_refs * sizeof(struct fuse_buf));
+  if (!scratch || !refs || !bufv)
     {
-      for (int i = 0; i < EDFS_INODE_N_BLOCKS; ++i)
-        if (inode.inode.blocks[i] != EDFS_BLOCK_INVALID)
-          edfs_free_block(img, inode.inode.blocks[i]);
+      free(scratch);
+      free(refs);
+      free(bufv);
+      fuse_reply_err(req, ENOMEM);
+      return;
     }
 
-  /* 3. remove directory entry from parent */
-  edfs_inode_t parent;
-  int rc = edfs_get_parent_inode(img, path, &parent);
-  if (rc < 0) return rc;
+  pthread_rwlock_rdlock(&node->lock);
 
-  const uint16_t ents = edfs_get_n_dir_entries_per_block(&img->sb);
-  edfs_dir_entry_t *buf = malloc(bs);
+  /* When the file is read sequentially, have the blocks after this
+   * read loaded while the data is transferred.
+   */
+  uint32_t first, count;
+  if (edfs_ra_update(&file->ra, offset, size, node->inode.inode.size,
+                     mount->img->sb.block_size, edfs_options.readahead,
+                     &first, &count))
+    {
+      if (mount->ra_queue)
+        edfs_ra_queue_submit(mount->ra_queue, file->inumber, first, count);
+      else
+        edfs_readahead(mount->img, &node->inode, first, count);
+    }
 
-  for (int i = 0; i < EDFS_INODE_N_BLOCKS; ++i)
+  /* Data held back lies in holes, which are read into the scratch
+   * buffer.
+   */
+  int n_refs;
+  ssize_t n = edfs_map_data(mount->img, &node->inode, offset, size,
+                            scratch, refs, &n_refs);
+  if (n > 0)
+    edfs_delalloc_read(mount->img, &node->da, offset, n, scratch);
+  if (n < 0)
+    fuse_reply_err(req, -n);
+  else
     {
-      edfs_block_t blk = parent.inode.blocks[i];
-      if (blk == EDFS_BLOCK_INVALID) continue;
-
-      off_t off = edfs_get_block_offset(&img->sb, blk);
-      pread(img->fd, buf, bs, off);
-
-      for (uint16_t j = 0; j < ents; ++j)
-        if (buf[j].inumber == inode.inumber)
-          {
-            memset(&buf[j], 0, sizeof(edfs_dir_entry_t));
-            pwrite(img->fd, buf, bs, off);
-            free(buf);
-            goto removed;
-          }
+      *bufv = FUSE_BUFVEC_INIT(0);
+      bufv->count = n_refs;
+      for (int i = 0; i < n_refs; ++i)
+        {
+          struct fuse_buf *b = &bufv->buf[i];
+
+          b->size = refs[i].len;
+          if (refs[i].mem)
+            {
+              b->flags = 0;
+              b->mem = (void *)refs[i].mem;
+            }
+          else
+            {
+              b->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK | FUSE_BUF_FD_RETRY;
+              b->fd = mount->img->fd;
+              b->pos = refs[i].pos;
+            }
+        }
+
+      /* The blocks may not be reused until the data has been sent. */
+      fuse_reply_data(req, bufv, FUSE_BUF_SPLICE_MOVE);
     }
-  free(buf);
-  return -EIO;                       /* should not happen */
+  pthread_rwlock_unlock(&node->lock);
 
-removed:
-  /* 4. clear inode */
-  edfs_clear_inode(img, &inode);
-  return 0;
+  free(scratch);
+  free(refs);
+  free(bufv);
 }
 
+/* Where edfuse_write_buf() takes the data from. */
+typedef struct
+{
+  struct fuse_bufvec *bufv;
+  int                 fd;
+} edfs_write_source_t;
 
+/* Move data from the request to the block cache or the image file;
+ * fuse_buf_copy() splices when the request arrived in a pipe.
+ */
 static int
-edfuse_read(const char *path, char *buf, size_t size, off_t offset,
-            struct fuse_file_info *fi)
+edfs_write_from_bufvec(void *userdata, char *dst, off_t pos, size_t len)
 {
-  edfs_image_t *img = get_edfs_image();
+  edfs_write_source_t *src = userdata;
+  struct fuse_bufvec out = FUSE_BUFVEC_INIT(len);
 
-  /* 1. Locate file inode */
-  edfs_inode_t inode;
-  if (!edfs_find_inode(img, path, &inode))
-    return -ENOENT;
-
-  if (edfs_disk_inode_is_directory(&inode.inode))
-    return -EISDIR;
-
-  /* 2. Clamp read size to file size */
-  if ((uint32_t)offset >= inode.inode.size)
-    return 0;                           /* reading past EOF returns 0 */
-
-  if (offset + size > inode.inode.size)
-    size = inode.inode.size - offset;
+  if (dst)
+    out.buf[0].mem = dst;
+  else
+    {
+      out.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK | FUSE_BUF_FD_RETRY;
+      out.buf[0].fd = src->fd;
+      out.buf[0].pos = pos;
+    }
 
-  size_t bytes_left = size;
-  size_t total_read = 0;
-  char  *dst        = buf;
+  ssize_t n = fuse_buf_copy(&out, src->bufv, 0);
+  if (n < 0)
+    return n;
+  return (size_t)n == len ? 0 : -EIO;
+}
 
-  while (bytes_left > 0)
+static void
+edfuse_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv,
+                 off_t offset, struct fuse_file_info *fi)
+{
+  edfs_mount_t *mount = get_edfs_mount(req);
+  edfs_node_t *node = &mount->nodes[get_edfs_file(fi)->inumber];
+  size_t size = fuse_buf_size(bufv);
+  ssize_t n;
+
+  pthread_rwlock_wrlock(&node->lock);
+  if (bufv->count == 1 && !(bufv->buf[0].flags & FUSE_BUF_IS_FD))
+    n = edfs_write_delayed(mount->img, &node->inode, &node->da, offset, size,
+                           bufv->buf[0].mem);
+  else if ((n = edfs_delalloc_flush(mount->img, &node->inode, &node->da)) == 0)
     {
-      edfs_block_t blk;
-      off_t        inblk;
-      int rc = edfs_block_for_offset(img, &inode, offset, &blk, &inblk);
-      if (rc < 0) return rc;
-
-      uint16_t bs = img->sb.block_size;
-      size_t chunk = bs - inblk;
-      if (chunk > bytes_left) chunk = bytes_left;
-
-      if (pread(img->fd, dst, chunk,
-                edfs_get_block_offset(&img->sb, blk) + inblk) != (ssize_t)chunk)
-        return -EIO;
-
-      /* advance pointers / counters */
-      dst         += chunk;
-      offset      += chunk;
-      bytes_left  -= chunk;
-      total_read  += chunk;
+      edfs_write_source_t src = { bufv, mount->img->fd };
+      n = edfs_write_data_from(mount->img, &node->inode, offset, size,
+                               edfs_write_from_bufvec, &src);
     }
+  pthread_rwlock_unlock(&node->lock);
 
-  return total_read;
+  if (n < 0)
+    fuse_reply_err(req, -n);
+  else
+    fuse_reply_write(req, n);
 }
 
+/* Only plain preallocation (mode 0) is supported. */
+static void
+edfuse_fallocate(fuse_req_t req, fuse_ino_t ino, int mode,
+                 off_t offset, off_t length, struct fuse_file_info *fi)
+{
+  edfs_mount_t *mount = get_edfs_mount(req);
+  edfs_node_t *node = &mount->nodes[get_edfs_file(fi)->inumber];
+
+  if (mode != 0)
+    { fuse_reply_err(req, EOPNOTSUPP); return; }
 
+  pthread_rwlock_wrlock(&node->lock);
+  int rc = edfs_delalloc_flush(mount->img, &node->inode, &node->da);
+  if (rc == 0)
+    rc = edfs_allocate_data(mount->img, &node->inode, offset, length);
+  pthread_rwlock_unlock(&node->lock);
+
+  fuse_reply_err(req, -rc);
+}
+
+/* Allocate blocks for the data of @fi that was held back. */
 static int
-edfuse_write(const char *path, const char *buf, size_t size, off_t offset,
-             struct fuse_file_info *fi)
+edfs_file_flush(edfs_mount_t *mount, struct fuse_file_info *fi)
 {
-  edfs_image_t *img = get_edfs_image();
+  edfs_node_t *node = &mount->nodes[get_edfs_file(fi)->inumber];
 
-  edfs_inode_t inode;
-  if (!edfs_find_inode(img, path, &inode))
-    return -ENOENT;
-  if (edfs_disk_inode_is_directory(&inode.inode))
-    return -EISDIR;
+  pthread_rwlock_wrlock(&node->lock);
+  int rc = edfs_delalloc_flush(mount->img, &node->inode, &node->da);
+  pthread_rwlock_unlock(&node->lock);
 
-  size_t bytes_left = size;
-  size_t written    = 0;
+  return rc;
+}
 
-  while (bytes_left > 0)
-    {
-      uint16_t bs = img->sb.block_size;
-      uint32_t logical = (offset + written) / bs;
-      off_t    inblk   = (offset + written) % bs;
+/* Write back cached metadata whenever a file descriptor is closed,
+ * so that the image is consistent once the last writer is done.
+ */
+static void
+edfuse_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+  edfs_mount_t *mount = get_edfs_mount(req);
 
-      edfs_block_t blk;
-      int rc = edfs_ensure_block(img, &inode, logical, &blk);
-      if (rc < 0) return rc;
+  int rc = edfs_file_flush(mount, fi);
+  if (rc == 0)
+    rc = edfs_image_sync(mount->img);
 
-      size_t chunk = bs - inblk;
-      if (chunk > bytes_left) chunk = bytes_left;
+  fuse_reply_err(req, -rc);
+}
 
-      if (pwrite(img->fd, buf + written, chunk,
-                 edfs_get_block_offset(&img->sb, blk) + inblk) != (ssize_t)chunk)
-        return -EIO;
+static void
+edfuse_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+             struct fuse_file_info *fi)
+{
+  edfs_mount_t *mount = get_edfs_mount(req);
+  edfs_image_t *img = mount->img;
 
-      written    += chunk;
-      bytes_left -= chunk;
-    }
+  int rc = edfs_file_flush(mount, fi);
+  if (rc == 0)
+    rc = edfs_image_sync(img);
+  if (rc == 0)
+    rc = edfs_io_sync(img->io, datasync);
+
+  fuse_reply_err(req, -rc);
+}
+
+/* Write the data that open files have held back for too long, then
+ * the metadata that has been modified for too long; runs on the
+ * flusher thread. Inodes that are in use are tried again on the next
+ * pass, and so is data that could not be written: it stays held until
+ * a flush or fsync reports the error.
+ */
+static void
+edfs_flush_expired(void *userdata)
+{
+  edfs_mount_t *mount = userdata;
+  edfs_image_t *img = mount->img;
 
-  /* update file size if extended */
-  if (offset + written > inode.inode.size)
+  for (edfs_inumber_t i = 1; i < img->sb.inode_table_n_inodes; ++i)
     {
-      inode.inode.size = offset + written;
-      edfs_write_inode(img, &inode);
+      edfs_node_t *node = &mount->nodes[i];
+
+      if (pthread_rwlock_trywrlock(&node->lock) != 0)
+        continue;
+      if (node->n_open > 0 && edfs_delalloc_expired(&node->da))
+        edfs_delalloc_flush(img, &node->inode, &node->da);
+      pthread_rwlock_unlock(&node->lock);
     }
-  return written;
-}
 
+  edfs_image_writeback(img);
+}
 
-static int
-edfuse_truncate(const char *path, off_t new_size)
+/* Load a read-ahead window; runs on the read-ahead thread. */
+static void
+edfs_ra_fill(void           *userdata,
+             edfs_inumber_t  inumber,
+             uint32_t        first,
+             uint32_t        count)
 {
-  edfs_image_t *img = get_edfs_image();
+  edfs_mount_t *mount = userdata;
   edfs_inode_t inode;
 
-  if (!edfs_find_inode(img, path, &inode))
-    return -ENOENT;
-  if (edfs_disk_inode_is_directory(&inode.inode))
-    return -EISDIR;
-  if (new_size < 0) return -EINVAL;
+  /* The file may have been closed, truncated or removed since the
+   * window was queued; with the inode locked its blocks stay put.
+   */
+  if (edfs_lock_inumber(mount, inumber, false, &inode) < 0)
+    return;
+
+  edfs_readahead(mount->img, &inode, first, count);
+  edfs_unlock_inode(mount, &inode);
+}
 
-  uint16_t bs = img->sb.block_size;
+/* Called once the session runs, after fuse_daemonize() forked, so
+ * that the read-ahead and reaper threads end up in the daemon.
+ */
+static void
+edfuse_init(void *userdata, struct fuse_conn_info *conn)
+{
+  edfs_mount_t *mount = userdata;
 
-  /* extend: just ensure last block exists */
-  if ((uint32_t)new_size > inode.inode.size)
+  /* Let read replies be spliced from the image file, and written data
+   * be spliced into it.
+   */
+  if (conn->capable & FUSE_CAP_SPLICE_WRITE)
+    conn->want |= FUSE_CAP_SPLICE_WRITE;
+  if (conn->capable & FUSE_CAP_SPLICE_MOVE)
+    conn->want |= FUSE_CAP_SPLICE_MOVE;
+  if (conn->capable & FUSE_CAP_SPLICE_READ)
+    conn->want |= FUSE_CAP_SPLICE_READ;
+
+  if (edfs_options.readahead > 0)
+    mount->ra_queue = edfs_ra_queue_new(edfs_ra_fill, mount);
+  if (edfs_options.async_unlink)
+    mount->reaper = edfs_reaper_new(edfs_reap_node, mount);
+
+  /* Without the flusher, dirty blocks and metadata are written back
+   * on sync and dirty blocks also when the dirty limit is hit; data
+   * held back by open files when they are flushed.
+   */
+  edfs_bcache_set_flush_hook(mount->img->bcache, edfs_flush_expired, mount);
+  int rc = edfs_bcache_start_flusher(mount->img->bcache);
+  if (rc < 0)
+    fprintf(stderr, "warning: cannot start flusher thread: %s\n",
+            strerror(-rc));
+}
+
+/* Called on unmount. The kernel does not send forgets for the inodes
+ * it still knows about, so removed inodes are released here.
+ */
+static void
+edfuse_destroy(void *userdata)
+{
+  edfs_mount_t *mount = userdata;
+  edfs_image_t *img = mount->img;
+
+  for (edfs_inumber_t i = 1; i < img->sb.inode_table_n_inodes; ++i)
     {
-      if (new_size != 0)
+      edfs_node_t *node = &mount->nodes[i];
+
+      /* Handles the kernel did not release. The flusher, reaper and
+       * read-ahead threads are still running.
+       */
+      pthread_rwlock_wrlock(&node->lock);
+      if (node->n_open > 0)
         {
-          uint32_t last_idx = (new_size - 1) / bs;
-          edfs_block_t blk;
-          int rc = edfs_ensure_block(img, &inode, last_idx, &blk);
-          if (rc < 0) return rc;
+          int rc = edfs_delalloc_flush(img, &node->inode, &node->da);
+          if (rc < 0)
+            fprintf(stderr, "warning: data written to inode %u lost: %s\n",
+                    i, strerror(-rc));
         }
-    }
-  /* shrink: we only free whole blocks beyond new_size */
-  else
-    {
-      uint32_t old_last = (inode.inode.size + bs - 1) / bs;
-      uint32_t new_last = (new_size        + bs - 1) / bs;
-      for (uint32_t i = new_last; i < old_last; ++i)
+      pthread_rwlock_unlock(&node->lock);
+      if (node->unlinked)
         {
-          off_t dummy;
-          edfs_block_t blk;
-          if (edfs_block_for_offset(img, &inode, i*bs, &blk, &dummy) == 0)
-            edfs_free_block(img, blk);
+          node->unlinked = false;
+          edfs_node_release(mount, i);
         }
     }
 
-  inode.inode.size = new_size;
-  if (edfs_write_inode(img, &inode) < 0)
-  return -EIO;
+  /* Finish the removed inodes that are still queued. */
+  edfs_reaper_stop(mount->reaper);
 
-  return 0;
-}
+  edfs_bcache_stop_flusher(img->bcache);
+  edfs_image_sync(img);
+  if (edfs_options.show_stats)
+    {
+      edfs_image_print_stats(img, stderr);
+      edfs_ra_queue_print_stats(mount->ra_queue, stderr);
+      if (edfs_options.async_unlink)
+        edfs_reaper_print_stats(mount->reaper, stderr);
+    }
 
-/* Some userland tools call utimens; we ignore time updates. */
-static int
-edfuse_utime(const char *path, struct utimbuf *buf)
-{
-  (void)path; (void)buf;
-  return 0;                 /* accept but ignore */
+  edfs_ra_queue_free(mount->ra_queue);
+  mount->ra_queue = NULL;
+  edfs_reaper_free(mount->reaper);
+  mount->reaper = NULL;
 }
 
-/* ftruncate on an open file-handle — delegate to our truncate logic */
-static int
-edfuse_ftruncate(const char *path, off_t size, struct fuse_file_info *fi)
-{
-  (void)fi;                 /* we don’t use the file-info */
-  return edfuse_truncate(path, size);
-}
+/*
+ * FUSE setup
+ */
 
-static int edfuse_chmod(const char *path, mode_t mode)
+static struct fuse_lowlevel_ops edfs_oper =
 {
-  (void)path; (void)mode;
-  return 0;             /* ignore permission changes */
-}
+  .init         = edfuse_init,
+  .lookup       = edfuse_lookup,
+  .forget       = edfuse_forget,
+  .forget_multi = edfuse_forget_multi,
+  .readdir      = edfuse_readdir,
+  .mkdir        = edfuse_mkdir,
+  .rmdir        = edfuse_rmdir,
+  .getattr      = edfuse_getattr,
+  .setattr      = edfuse_setattr,
+  .open         = edfuse_open,
+  .release      = edfuse_release,
+  .create       = edfuse_create,
+  .unlink       = edfuse_unlink,
+  .read         = edfuse_read,
+  .write_buf    = edfuse_write_buf,
+  .fallocate    = edfuse_fallocate,
+  .flush        = edfuse_flush,
+  .fsync        = edfuse_fsync,
+  .destroy      = edfuse_destroy,
+};
+
+#define EDFS_OPT(t, p, v) { t, offsetof(struct edfs_options, p), v }
 
-static int edfuse_chown(const char *path, uid_t uid, gid_t gid)
+static const struct fuse_opt edfs_opts[] =
 {
-  (void)path; (void)uid; (void)gid;
-  return 0;             /* ignore ownership changes */
-}
+  EDFS_OPT("stats", show_stats, 1),
+  EDFS_OPT("cache_blocks=%zu", image_options.cache_blocks, 0),
+  EDFS_OPT("entry_timeout=%lf", entry_timeout, 0),
+  EDFS_OPT("attr_timeout=%lf", attr_timeout, 0),
+  EDFS_OPT("readahead=%u", readahead, 0),
+  EDFS_OPT("io=pread", image_options.io_backend, EDFS_IO_PREAD),
+  EDFS_OPT("io=mmap", image_options.io_backend, EDFS_IO_MMAP),
+  EDFS_OPT("io=uring", image_options.io_backend, EDFS_IO_URING),
+  EDFS_OPT("dirty_ratio=%u", image_options.dirty_ratio, 0),
+  EDFS_OPT("async_unlink", async_unlink, 1),
+  FUSE_OPT_END
+};
 
-/*
- * FUSE setup
+/* The first non-option argument is the image file; everything else,
+ * including the mountpoint, is passed on to FUSE.
  */
+static int
+edfs_opt_proc(void *data, const char *arg, int key,
+              struct fuse_args *outargs)
+{
+  struct edfs_options *opts = data;
 
-static struct fuse_operations edfs_oper =
-{
-  .readdir   = edfuse_readdir,
-  .mkdir     = edfuse_mkdir,
-  .rmdir     = edfuse_rmdir,
-  .getattr   = edfuse_getattr,
-  .open      = edfuse_open,
-  .create    = edfuse_create,
-  .unlink    = edfuse_unlink,
-  .read      = edfuse_read,
-  .write     = edfuse_write,
-  .chmod     = edfuse_chmod,     
-  .chown     = edfuse_chown,
-  .truncate  = edfuse_truncate,
-  .ftruncate = edfuse_ftruncate,
-  .utime  = edfuse_utime,
-};
+  if (key == FUSE_OPT_KEY_NONOPT && !opts->image)
+    {
+      opts->image = strdup(arg);
+      return 0;
+    }
+
+  return 1;
+}
 
 int
 main(int argc, char *argv[])
 {
-  /* Count number of arguments without hyphens; excluding execname */
-  int count = 0;
-  for (int i = 1; i < argc; ++i)
-    if (argv[i][0] != '-')
-      count++;
+  struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+  char *mountpoint = NULL;
+  int multithreaded, foreground;
+  int ret = -1;
+
+  if (fuse_opt_parse(&args, &edfs_options, edfs_opts, edfs_opt_proc) < 0)
+    return -1;
+
+  if (fuse_parse_cmdline(&args, &mountpoint, &multithreaded,
+                         &foreground) < 0)
+    return -1;
 
-  if (count != 2)
+  if (!edfs_options.image || !mountpoint)
     {
       fprintf(stderr, "error: file and mountpoint arguments required.\n");
       return -1;
     }
 
-  /* Extract filename argument; we expect this to be the
-   * penultimate argument.
+  /* A window must fit in the block cache several times over, or the
+   * blocks read ahead are evicted before they are used.
    */
-  /* FIXME: can't this be better handled using some FUSE API? */
-  const char *filename = argv[argc-2];
-  argv[argc-2] = argv[argc-1];
-  argv[argc-1] = NULL;
-  argc--;
+  size_t cache_blocks = edfs_options.image_options.cache_blocks;
+  if (cache_blocks == 0)
+    cache_blocks = EDFS_BCACHE_N_FRAMES;
+  if (edfs_options.readahead > cache_blocks / 4)
+    edfs_options.readahead = cache_blocks / 4;
 
   /* Try to open the file system */
-  edfs_image_t *img = edfs_image_open(filename, true);
-  if (!img)
+  edfs_mount_t mount = { 0, };
+  mount.img = edfs_image_open(edfs_options.image, true,
+                              &edfs_options.image_options);
+  if (!mount.img)
     return -1;
 
+  /* Inodes removed by a previous mount that did not get to free them. */
+  int n_orphans = edfs_recover_orphans(mount.img);
+  if (n_orphans < 0)
+    fprintf(stderr, "warning: cannot free orphaned inodes: %s\n",
+            strerror(-n_orphans));
+  else if (n_orphans > 0)
+    fprintf(stderr, "freed %d orphaned inodes\n", n_orphans);
+
+  mount.nodes = calloc(mount.img->sb.inode_table_n_inodes,
+                       sizeof(edfs_node_t));
+  if (!mount.nodes)
+    goto out_image;
+
+  pthread_mutex_init(&mount.node_lock, NULL);
+  for (edfs_inumber_t i = 0; i < mount.img->sb.inode_table_n_inodes; ++i)
+    pthread_rwlock_init(&mount.nodes[i].lock, NULL);
+
   /* Start fuse main loop */
-  int ret = fuse_main(argc, argv, &edfs_oper, img);
-  edfs_image_close(img);
+  struct fuse_chan *ch = fuse_mount(mountpoint, &args);
+  if (!ch)
+    goto out_nodes;
+
+  struct fuse_session *se = fuse_lowlevel_new(&args, &edfs_oper,
+                                              sizeof(edfs_oper), &mount);
+  if (se)
+    {
+      if (fuse_set_signal_handlers(se) == 0)
+        {
+          fuse_session_add_chan(se, ch);
+          fuse_daemonize(foreground);
+
+          ret = multithreaded ? fuse_session_loop_mt(se)
+                              : fuse_session_loop(se);
+
+          fuse_remove_signal_handlers(se);
+          fuse_session_remove_chan(ch);
+        }
+      fuse_session_destroy(se);
+    }
+  fuse_unmount(mountpoint, ch);
+
+out_nodes:
+  for (edfs_inumber_t i = 0; i < mount.img->sb.inode_table_n_inodes; ++i)
+    pthread_rwlock_destroy(&mount.nodes[i].lock);
+  pthread_mutex_destroy(&mount.node_lock);
+  free(mount.nodes);
+out_image:
+  edfs_image_close(mount.img);
+  free(mountpoint);
+  fuse_opt_free_args(&args);
 
   return ret;
 }
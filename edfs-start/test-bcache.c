@@ -0,0 +1,214 @@
+/* EdFS -- An educational file system
+ *
+ * Copyright (C) 2019  Leiden University, The Netherlands.
+ */
+
+/* Stress test for the block cache: several threads get, modify and
+ * put blocks through a cache much smaller than the image, so that
+ * misses, evictions and write-backs happen all the time, while others
+ * flush, read ahead and invalidate. Every thread owns its own blocks,
+ * as an inode lock would make it do in the file system; the last
+ * TEST_N_SHARED blocks are only read, by all threads at once.
+ * Afterwards the image must hold the last version of every block.
+ *
+ * Run with "make check".
+ */
+
+#include "edfs-bcache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#define TEST_BLOCK_SIZE  512
+#define TEST_N_BLOCKS    512
+#define TEST_N_SHARED    64       /* read by all, at the end */
+#define TEST_N_FRAMES    32
+#define TEST_N_THREADS   8
+#define TEST_ITERATIONS  20000
+
+typedef struct
+{
+  edfs_bcache_t *bc;
+  unsigned       id;
+  unsigned       seed;
+  uint32_t       version[TEST_N_BLOCKS];   /* of the blocks it owns */
+  int            errors;
+} test_thread_t;
+
+/* A block is filled with its number and version. */
+static void
+test_fill(uint8_t *data, edfs_block_t block, uint32_t version)
+{
+  uint32_t *words = (uint32_t *)data;
+  for (size_t i = 0; i < TEST_BLOCK_SIZE / sizeof(uint32_t); i += 2)
+    {
+      words[i] = block;
+      words[i + 1] = version;
+    }
+}
+
+static bool
+test_check(const uint8_t *data, edfs_block_t block, uint32_t version)
+{
+  uint8_t expected[TEST_BLOCK_SIZE];
+  test_fill(expected, block, version);
+  return memcmp(data, expected, TEST_BLOCK_SIZE) == 0;
+}
+
+static void *
+test_thread(void *data)
+{
+  test_thread_t *t = data;
+
+  for (int i = 0; i < TEST_ITERATIONS; ++i)
+    {
+      const unsigned n_owned = (TEST_N_BLOCKS - TEST_N_SHARED) / TEST_N_THREADS;
+      edfs_block_t block = rand_r(&t->seed) % n_owned * TEST_N_THREADS + t->id;
+      edfs_buf_t *buf;
+      unsigned what = rand_r(&t->seed) % 100;
+
+      if (what < 2)
+        {
+          if (edfs_bcache_flush(t->bc) < 0)
+            t->errors++;
+          continue;
+        }
+      if (what < 4)
+        {
+          /* Read ahead some blocks of other threads; not checked. */
+          edfs_block_t first = rand_r(&t->seed) % (TEST_N_BLOCKS - 8);
+          edfs_bcache_prefetch(t->bc, first, 8);
+          continue;
+        }
+      if (what < 30)
+        {
+          uint8_t data[TEST_BLOCK_SIZE];
+          edfs_block_t shared = TEST_N_BLOCKS - 1 -
+                                rand_r(&t->seed) % TEST_N_SHARED;
+          if (edfs_bcache_read(t->bc, shared, 0, TEST_BLOCK_SIZE, data) < 0)
+            t->errors++;
+          else if (!test_check(data, shared, 0))
+            {
+              fprintf(stderr, "block %u: wrong contents in the cache\n",
+                      shared);
+              t->errors++;
+            }
+          continue;
+        }
+      if (what < 32)
+        {
+          /* Like a freed block that is reused: the frame is dropped
+           * and the block written in full.
+           */
+          uint8_t data[TEST_BLOCK_SIZE];
+          edfs_bcache_invalidate(t->bc, block);
+          test_fill(data, block, ++t->version[block]);
+          if (edfs_bcache_write(t->bc, block, 0, TEST_BLOCK_SIZE, data) < 0)
+            t->errors++;
+          continue;
+        }
+
+      if (edfs_bcache_get(t->bc, block, true, &buf) < 0)
+        {
+          t->errors++;
+          continue;
+        }
+
+      if (!test_check(buf->data, block, t->version[block]))
+        {
+          fprintf(stderr, "block %u: wrong contents in the cache\n", block);
+          t->errors++;
+        }
+
+      if (what < 60)
+        {
+          test_fill(buf->data, block, ++t->version[block]);
+          edfs_bcache_mark_dirty(t->bc, buf);
+        }
+      edfs_bcache_put(t->bc, buf);
+    }
+
+  return NULL;
+}
+
+int
+main(void)
+{
+  char filename[] = "/tmp/edfs-test-bcache-XXXXXX";
+  int fd = mkstemp(filename);
+  if (fd < 0)
+    {
+      perror("mkstemp");
+      return 1;
+    }
+  unlink(filename);
+
+  /* Every block starts out at version 0. */
+  uint8_t data[TEST_BLOCK_SIZE];
+  for (edfs_block_t b = 0; b < TEST_N_BLOCKS; ++b)
+    {
+      test_fill(data, b, 0);
+      if (pwrite(fd, data, TEST_BLOCK_SIZE, (off_t)b * TEST_BLOCK_SIZE)
+          != TEST_BLOCK_SIZE)
+        {
+          perror("pwrite");
+          return 1;
+        }
+    }
+
+  edfs_io_t *io = edfs_io_new(fd);
+  edfs_bcache_t *bc = edfs_bcache_new(io, TEST_BLOCK_SIZE, TEST_N_BLOCKS,
+                                      TEST_N_FRAMES);
+  if (!io || !bc)
+    {
+      fprintf(stderr, "cannot create the block cache\n");
+      return 1;
+    }
+  edfs_bcache_set_dirty_ratio(bc, 25);
+  edfs_bcache_start_flusher(bc);
+
+  static test_thread_t threads[TEST_N_THREADS];
+  pthread_t tids[TEST_N_THREADS];
+  for (unsigned i = 0; i < TEST_N_THREADS; ++i)
+    {
+      threads[i].bc = bc;
+      threads[i].id = i;
+      threads[i].seed = i + 1;
+      pthread_create(&tids[i], NULL, test_thread, &threads[i]);
+    }
+
+  int errors = 0;
+  for (unsigned i = 0; i < TEST_N_THREADS; ++i)
+    {
+      pthread_join(tids[i], NULL);
+      errors += threads[i].errors;
+    }
+
+  edfs_bcache_stop_flusher(bc);
+  if (edfs_bcache_flush(bc) < 0)
+    errors++;
+
+  for (edfs_block_t b = 0; b < TEST_N_BLOCKS; ++b)
+    {
+      uint32_t version = b < TEST_N_BLOCKS - TEST_N_SHARED ?
+                         threads[b % TEST_N_THREADS].version[b] : 0;
+      if (pread(fd, data, TEST_BLOCK_SIZE, (off_t)b * TEST_BLOCK_SIZE)
+          != TEST_BLOCK_SIZE || !test_check(data, b, version))
+        {
+          fprintf(stderr, "block %u: wrong contents on the image\n", b);
+          errors++;
+        }
+    }
+
+  edfs_bcache_print_stats(bc, stdout);
+  edfs_bcache_free(bc);
+  edfs_io_free(io);
+  close(fd);
+
+  printf("test-bcache: %s\n", errors ? "FAILED" : "ok");
+  return errors ? 1 : 0;
+}